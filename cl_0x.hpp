@@ -42,9 +42,38 @@
 #include <fstream>
 #include <string>
 #include <cstring>
-
-#ifdef DEBUG
+#include <cstdlib>
 #include <cstdio>
+#include <cmath>
+#include <vector>
+#include <functional>
+#include <regex>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <tuple>
+#include <set>
+#include <new>
+#include <utility>
+#include <algorithm>
+#include <type_traits>
+#include <thread>
+#include <future>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+
+#if !defined(CL0X_NO_SIMD) && defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 
 namespace cl_0x {
@@ -53,6 +82,8 @@ namespace cl_0x {
 // forward declarations (needed for argument size and pointer deduction)
 template <typename CLType, cl_int (*RFunc)(CLType)> struct CLObjContainer;
 template <typename T> struct Buffer;
+template <unsigned Dim> struct Image;
+struct Sampler;
 
 
 /**
@@ -121,6 +152,64 @@ struct CLTypeTraits <Buffer<T>>
 };
 
 
+template <unsigned Dim>
+struct CLTypeTraits <Image<Dim>>
+{
+	static size_t
+	size (const Image<Dim> &)
+	{
+		return sizeof(cl_mem);
+	}
+};
+
+
+template <>
+struct CLTypeTraits <Sampler>
+{
+	static size_t
+	size (const Sampler &)
+	{
+		return sizeof(cl_sampler);
+	}
+};
+
+
+/**
+ * the CLTypeName class maps host types to their OpenCL C counterparts for
+ * generating kernel source.
+ *
+ * @name:	OpenCL C type name
+ * @max:	largest value of the type
+ * @lowest:	smallest value of the type
+ * @pragma:	extension pragma needed to use the type, or an empty string
+ */
+template <typename T> struct CLTypeName;
+
+#define CL0X_TYPE_NAME(TYPE, NAME, MAX, LOWEST, PRAGMA)			\
+	template <>							\
+	struct CLTypeName <TYPE>					\
+	{								\
+		static const char* name () { return NAME; }		\
+		static const char* max () { return MAX; }		\
+		static const char* lowest () { return LOWEST; }	\
+		static const char* pragma () { return PRAGMA; }		\
+	};
+
+CL0X_TYPE_NAME(cl_char, "char", "CHAR_MAX", "CHAR_MIN", "")
+CL0X_TYPE_NAME(cl_uchar, "uchar", "UCHAR_MAX", "0", "")
+CL0X_TYPE_NAME(cl_short, "short", "SHRT_MAX", "SHRT_MIN", "")
+CL0X_TYPE_NAME(cl_ushort, "ushort", "USHRT_MAX", "0", "")
+CL0X_TYPE_NAME(cl_int, "int", "INT_MAX", "INT_MIN", "")
+CL0X_TYPE_NAME(cl_uint, "uint", "UINT_MAX", "0", "")
+CL0X_TYPE_NAME(cl_long, "long", "LONG_MAX", "LONG_MIN", "")
+CL0X_TYPE_NAME(cl_ulong, "ulong", "ULONG_MAX", "0", "")
+CL0X_TYPE_NAME(cl_float, "float", "INFINITY", "-INFINITY", "")
+CL0X_TYPE_NAME(cl_double, "double", "INFINITY", "-INFINITY",
+		"#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n")
+
+#undef CL0X_TYPE_NAME
+
+
 /**
  * Argument Wrapper to make it possible to pass local memory to the kernel by
  * set_kernel_args
@@ -168,8 +257,27 @@ struct KernelArg <Buffer<T>>
 };
 
 
+template <unsigned Dim>
+struct KernelArg <Image<Dim>>
+{
+	static const void*
+	ptr (const Image<Dim> &arg)
+	{
+		return &(arg.cl_obj);
+	}
+};
 
-cl_int
+
+template <>
+struct KernelArg <Sampler>
+{
+	static const void*
+	ptr (const Sampler &arg);
+};
+
+
+
+inline cl_int
 set_kernel_args (cl_kernel &, unsigned int)
 {
 	return CL_SUCCESS;
@@ -184,8 +292,9 @@ set_kernel_args (cl_kernel &k, int n, const T &arg, const Args&... args)
 	err = clSetKernelArg(k, n,
 			CLTypeTraits<T>::size(arg),
 			KernelArg<T>::ptr(arg));
-	return err |
-	       set_kernel_args(k, n+1, args...);
+	if (err != CL_SUCCESS)
+		return err;
+	return set_kernel_args(k, n+1, args...);
 }
 
 
@@ -207,7 +316,14 @@ constexpr cl_int empty_release (T*) { return CL_SUCCESS; }
 
 
 /**
+ * struct CLObjContainer - owner of an OpenCL object.
  *
+ * Containers are move-only: the object is released exactly once by the
+ * container that owns it last, so containers can be returned from functions
+ * and stored by value in standard containers. Objects that are referenced
+ * by junctions (e.g. a CommandQueue a Kernel is bound to) must not be moved
+ * while they are referenced. To share an object without transferring
+ * ownership, hold it with release_on_destroy set to false.
  */
 template <typename CLType, cl_int (*RFunc)(CLType) = empty_release>
 struct CLObjContainer
@@ -235,6 +351,32 @@ struct CLObjContainer
 	{}
 
 
+	CLObjContainer (const CLObjContainer &) = delete;
+	CLObjContainer& operator= (const CLObjContainer &) = delete;
+
+
+	/**
+	 * take over the object of @other, which is left empty
+	 */
+	CLObjContainer (CLObjContainer &&other)
+		: cl_obj(other.cl_obj)
+		, release_on_destroy(other.release_on_destroy)
+	{
+		other.cl_obj = NULL;
+	}
+
+
+	CLObjContainer&
+	operator= (CLObjContainer &&other)
+	{
+		if (this != &other) {
+			reset(other.cl_obj, other.release_on_destroy);
+			other.cl_obj = NULL;
+		}
+		return *this;
+	}
+
+
 	~CLObjContainer ()
 	{
 		if (release_on_destroy && this->cl_obj)
@@ -246,11 +388,60 @@ struct CLObjContainer
 	{
 		return this->cl_obj;
 	}
+
+
+	/**
+	 * release the contained object (if owned by this container) and hold
+	 * @cl_obj instead
+	 */
+	void
+	reset (CLType cl_obj = NULL, bool release_on_destroy = true)
+	{
+		if (this->release_on_destroy && this->cl_obj)
+			RFunc(this->cl_obj);
+		this->cl_obj = cl_obj;
+		this->release_on_destroy = release_on_destroy;
+	}
+
+
+	/**
+	 * give up ownership of the contained object and return it
+	 */
+	CLType
+	detach ()
+	{
+		CLType obj = this->cl_obj;
+		this->cl_obj = NULL;
+		return obj;
+	}
 };
 
 
+/**
+ * platform and device ids are not reference counted, so unlike the other
+ * containers they can be copied
+ */
 struct Platform : CLObjContainer<cl_platform_id>
 {
+	explicit
+	Platform (cl_platform_id platform = NULL)
+		: CLObjContainer(platform)
+	{}
+
+
+	Platform (const Platform &other)
+		: CLObjContainer(other.cl_obj)
+	{}
+
+
+	Platform&
+	operator= (const Platform &other)
+	{
+		this->cl_obj = other.cl_obj;
+		return *this;
+	}
+
+
 	cl_int
 	select_first ()
 	{
@@ -261,6 +452,25 @@ struct Platform : CLObjContainer<cl_platform_id>
 
 struct Device : CLObjContainer<cl_device_id>
 {
+	explicit
+	Device (cl_device_id device = NULL)
+		: CLObjContainer(device)
+	{}
+
+
+	Device (const Device &other)
+		: CLObjContainer(other.cl_obj)
+	{}
+
+
+	Device&
+	operator= (const Device &other)
+	{
+		this->cl_obj = other.cl_obj;
+		return *this;
+	}
+
+
 	cl_int
 	select_first (const Platform &platform, cl_device_type devtype)
 	{
@@ -269,6 +479,301 @@ struct Device : CLObjContainer<cl_device_id>
 	}
 };
 
+
+/**
+ * query a string valued platform property. returns an empty string on failure
+ */
+inline std::string
+platform_info_string (cl_platform_id platform, cl_platform_info param)
+{
+	size_t len = 0;
+	if (clGetPlatformInfo(platform, param, 0, NULL, &len) != CL_SUCCESS
+	    || !len)
+		return std::string();
+
+	std::vector<char> buf(len);
+	if (clGetPlatformInfo(platform, param, len, &buf[0], NULL)
+	    != CL_SUCCESS)
+		return std::string();
+	return std::string(&buf[0]);
+}
+
+
+/**
+ * query a string valued device property. returns an empty string on failure
+ */
+inline std::string
+device_info_string (cl_device_id device, cl_device_info param)
+{
+	size_t len = 0;
+	if (clGetDeviceInfo(device, param, 0, NULL, &len) != CL_SUCCESS || !len)
+		return std::string();
+
+	std::vector<char> buf(len);
+	if (clGetDeviceInfo(device, param, len, &buf[0], NULL) != CL_SUCCESS)
+		return std::string();
+	return std::string(&buf[0]);
+}
+
+
+/**
+ * query a scalar device property
+ */
+template <typename T>
+inline cl_int
+device_info (cl_device_id device, cl_device_info param, T *value)
+{
+	return clGetDeviceInfo(device, param, sizeof(T), value, NULL);
+}
+
+
+/**
+ * struct DeviceInfo - the properties of a device that are relevant for
+ * selecting a device and for choosing launch parameters.
+ *
+ * @vector_width:	preferred vector widths for char, short, int, long,
+ *			float and double (in this order)
+ */
+struct DeviceInfo
+{
+	cl_platform_id platform;
+	cl_device_id device;
+
+	std::string platform_name;
+	std::string name;
+	std::string vendor;
+	std::string version;
+	std::string driver_version;
+
+	cl_device_type type;
+	cl_uint compute_units;
+	cl_uint clock_frequency;
+	cl_ulong global_mem_size;
+	cl_ulong local_mem_size;
+	cl_ulong max_mem_alloc_size;
+	size_t max_work_group_size;
+	cl_uint mem_base_addr_align;
+	cl_bool host_unified_memory;
+	cl_uint vector_width[6];
+
+
+	enum {
+		CHAR = 0, SHORT, INT, LONG, FLOAT, DOUBLE
+	};
+
+
+	DeviceInfo ()
+		: platform(NULL), device(NULL), type(0), compute_units(0)
+		, clock_frequency(0), global_mem_size(0), local_mem_size(0)
+		, max_mem_alloc_size(0), max_work_group_size(0)
+		, mem_base_addr_align(0), host_unified_memory(CL_FALSE)
+	{
+		memset(vector_width, 0, sizeof(vector_width));
+	}
+
+
+	/**
+	 * read all properties of @device
+	 */
+	cl_int
+	query (cl_device_id device)
+	{
+		cl_int err;
+		this->device = device;
+
+		err = device_info(device, CL_DEVICE_PLATFORM, &platform);
+		if (err == CL_SUCCESS)
+			err = device_info(device, CL_DEVICE_TYPE, &type);
+		if (err == CL_SUCCESS)
+			err = device_info(device, CL_DEVICE_MAX_COMPUTE_UNITS,
+					&compute_units);
+		if (err == CL_SUCCESS)
+			err = device_info(device, CL_DEVICE_MAX_CLOCK_FREQUENCY,
+					&clock_frequency);
+		if (err == CL_SUCCESS)
+			err = device_info(device, CL_DEVICE_GLOBAL_MEM_SIZE,
+					&global_mem_size);
+		if (err == CL_SUCCESS)
+			err = device_info(device, CL_DEVICE_LOCAL_MEM_SIZE,
+					&local_mem_size);
+		if (err == CL_SUCCESS)
+			err = device_info(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE,
+					&max_mem_alloc_size);
+		if (err == CL_SUCCESS)
+			err = device_info(device, CL_DEVICE_MAX_WORK_GROUP_SIZE,
+					&max_work_group_size);
+		if (err == CL_SUCCESS)
+			err = device_info(device, CL_DEVICE_MEM_BASE_ADDR_ALIGN,
+					&mem_base_addr_align);
+		if (err != CL_SUCCESS)
+			return CL_INVALID_DEVICE;
+
+		// OpenCL 1.1 properties, leave the defaults on older devices
+		device_info(device, CL_DEVICE_HOST_UNIFIED_MEMORY,
+				&host_unified_memory);
+		const cl_device_info vw[] = {
+			CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR,
+			CL_DEVICE_PREFERRED_VECTOR_WIDTH_SHORT,
+			CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT,
+			CL_DEVICE_PREFERRED_VECTOR_WIDTH_LONG,
+			CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT,
+			CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE
+		};
+		for (int i = 0; i < 6; i++)
+			device_info(device, vw[i], &vector_width[i]);
+
+		platform_name = platform_info_string(platform, CL_PLATFORM_NAME);
+		name = device_info_string(device, CL_DEVICE_NAME);
+		vendor = device_info_string(device, CL_DEVICE_VENDOR);
+		version = device_info_string(device, CL_DEVICE_VERSION);
+		driver_version = device_info_string(device, CL_DRIVER_VERSION);
+		return CL_SUCCESS;
+	}
+};
+
+
+/**
+ * enumerate the devices of type @type on all platforms
+ */
+inline cl_int
+enumerate_devices (std::vector<DeviceInfo> &devices,
+		cl_device_type type = CL_DEVICE_TYPE_ALL)
+{
+	cl_int err;
+	cl_uint nplatforms = 0;
+
+	devices.clear();
+	err = clGetPlatformIDs(0, NULL, &nplatforms);
+	if (err != CL_SUCCESS)
+		return err;
+	if (!nplatforms)
+		return CL_INVALID_PLATFORM;
+
+	std::vector<cl_platform_id> platforms(nplatforms);
+	err = clGetPlatformIDs(nplatforms, &platforms[0], NULL);
+	if (err != CL_SUCCESS)
+		return err;
+
+	for (cl_uint p = 0; p < nplatforms; p++) {
+		cl_uint ndevices = 0;
+		// platforms without devices of the requested type are skipped
+		if (clGetDeviceIDs(platforms[p], type, 0, NULL, &ndevices)
+		    != CL_SUCCESS || !ndevices)
+			continue;
+
+		std::vector<cl_device_id> ids(ndevices);
+		if (clGetDeviceIDs(platforms[p], type, ndevices, &ids[0], NULL)
+		    != CL_SUCCESS)
+			continue;
+
+		for (cl_uint d = 0; d < ndevices; d++) {
+			DeviceInfo info;
+			if (info.query(ids[d]) == CL_SUCCESS)
+				devices.push_back(info);
+		}
+	}
+	return devices.empty() ? CL_DEVICE_NOT_FOUND : CL_SUCCESS;
+}
+
+
+/**
+ * device selection policies for select_device
+ *
+ * @DEVICE_FIRST:		first device that was found
+ * @DEVICE_MOST_COMPUTE_UNITS:	most compute units, clock frequency breaks ties
+ * @DEVICE_MOST_MEMORY:		largest global memory
+ * @DEVICE_NAME_REGEX:		first device whose "platform name: device name"
+ *				matches a regular expression
+ */
+enum DevicePolicy {
+	DEVICE_FIRST,
+	DEVICE_MOST_COMPUTE_UNITS,
+	DEVICE_MOST_MEMORY,
+	DEVICE_NAME_REGEX
+};
+
+
+/**
+ * select a device of type @type out of all platforms. when the environment
+ * variable CL0X_DEVICE is set, it overrides the policy: a number selects the
+ * device by its index in the enumeration, anything else is used as a regular
+ * expression on "platform name: device name".
+ *
+ * @pattern:	regular expression for DEVICE_NAME_REGEX
+ * @info:	if not NULL, receives the properties of the selected device
+ */
+inline cl_int
+select_device (Platform &platform, Device &device,
+		DevicePolicy policy = DEVICE_FIRST,
+		cl_device_type type = CL_DEVICE_TYPE_ALL,
+		const char *pattern = NULL, DeviceInfo *info = NULL)
+{
+	std::vector<DeviceInfo> devices;
+	cl_int err = enumerate_devices(devices, type);
+	if (err != CL_SUCCESS)
+		return err;
+
+	const char *env = getenv("CL0X_DEVICE");
+	if (env && *env) {
+		char *end;
+		unsigned long idx = strtoul(env, &end, 10);
+		if (!*end) {
+			if (idx >= devices.size())
+				return CL_DEVICE_NOT_FOUND;
+			policy = DEVICE_FIRST;
+			devices.erase(devices.begin(), devices.begin() + idx);
+		}
+		else {
+			policy = DEVICE_NAME_REGEX;
+			pattern = env;
+		}
+	}
+
+	size_t best = devices.size();
+	if (policy == DEVICE_NAME_REGEX) {
+		if (!pattern)
+			return CL_INVALID_VALUE;
+		try {
+			std::regex re(pattern, std::regex::icase);
+			for (size_t i = 0; i < devices.size(); i++) {
+				std::string n = devices[i].platform_name + ": "
+					+ devices[i].name;
+				if (std::regex_search(n, re)) {
+					best = i;
+					break;
+				}
+			}
+		}
+		catch (const std::regex_error &) {
+			return CL_INVALID_VALUE;
+		}
+	}
+	else {
+		best = 0;
+		for (size_t i = 1; i < devices.size(); i++) {
+			const DeviceInfo &a = devices[i], &b = devices[best];
+			bool better = false;
+			if (policy == DEVICE_MOST_COMPUTE_UNITS)
+				better = (a.compute_units > b.compute_units)
+					|| (a.compute_units == b.compute_units
+					    && a.clock_frequency
+					       > b.clock_frequency);
+			else if (policy == DEVICE_MOST_MEMORY)
+				better = a.global_mem_size > b.global_mem_size;
+			if (better)
+				best = i;
+		}
+	}
+	if (best == devices.size())
+		return CL_DEVICE_NOT_FOUND;
+
+	platform.cl_obj = devices[best].platform;
+	device.cl_obj = devices[best].device;
+	if (info)
+		*info = devices[best];
+	return CL_SUCCESS;
+}
+
 struct DeviceJunction
 {
 	const Device *device;
@@ -294,6 +799,28 @@ struct Context : CLObjContainer<cl_context, clReleaseContext>
 				&err);
 		return err;
 	}
+
+
+	/**
+	 * create a context shared by several devices of one platform
+	 */
+	cl_int
+	create (const Platform &platform, const std::vector<Device> &devices)
+	{
+		cl_int err;
+		if (devices.empty())
+			return CL_INVALID_VALUE;
+
+		std::vector<cl_device_id> ids(devices.size());
+		for (size_t i = 0; i < devices.size(); i++)
+			ids[i] = devices[i]();
+
+		cl_context_properties props[] = {CL_CONTEXT_PLATFORM,
+			(cl_context_properties)platform(), 0};
+		this->cl_obj = clCreateContext(props, ids.size(), &ids[0], NULL,
+				NULL, &err);
+		return err;
+	}
 };
 
 struct ContextJunction
@@ -312,14 +839,46 @@ struct ContextJunction
 struct CommandQueue : CLObjContainer<cl_command_queue, clReleaseCommandQueue>
 		, ContextJunction, DeviceJunction
 {
+	/**
+	 * create a command queue on a device
+	 *
+	 * @properties:	CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE and/or
+	 *		CL_QUEUE_PROFILING_ENABLE
+	 */
 	cl_int
-	create (const Device &device, const Context &context)
+	create (const Device &device, const Context &context,
+			cl_command_queue_properties properties = 0)
 	{
 		cl_int err;
-		this->cl_obj = clCreateCommandQueue(context(), device(), 0,
-				&err);
+		this->cl_obj = clCreateCommandQueue(context(), device(),
+				properties, &err);
+		this->ContextJunction::bind_to(context);
+		this->DeviceJunction::bind_to(device);
 		return err;
 	}
+
+
+	cl_int
+	properties (cl_command_queue_properties *properties) const
+	{
+		return clGetCommandQueueInfo(this->cl_obj, CL_QUEUE_PROPERTIES,
+				sizeof(cl_command_queue_properties),
+				properties, NULL);
+	}
+
+
+	cl_int
+	flush () const
+	{
+		return clFlush(this->cl_obj);
+	}
+
+
+	cl_int
+	finish () const
+	{
+		return clFinish(this->cl_obj);
+	}
 };
 
 struct CommandQueueJunction
@@ -335,271 +894,7328 @@ struct CommandQueueJunction
 };
 
 
-struct Program : CLObjContainer<cl_program, clReleaseProgram>
-		 , ContextJunction
+/**
+ * struct EventTimes - profiling timestamps of a command in nanoseconds.
+ *
+ * @queued:	the command was enqueued by the host
+ * @submit:	the command was submitted to the device
+ * @start:	execution started
+ * @end:	execution finished
+ */
+struct EventTimes
 {
-	cl_int
-	build_from_source (const Context &context, const char *src)
-	{
-		cl_int err;
-		size_t len[] = {strlen(src)};
-		this->cl_obj = clCreateProgramWithSource(context(), 1, &src,
-				len, &err);
-		if (err != CL_SUCCESS)
-			return err;
+	cl_ulong queued;
+	cl_ulong submit;
+	cl_ulong start;
+	cl_ulong end;
 
-		return clBuildProgram(this->cl_obj, 0, NULL, NULL, NULL, NULL);
-	}
 
+	EventTimes () : queued(0), submit(0), start(0), end(0) {}
 
-	cl_int
-	build_from_file (const Context &context, const char *fname)
-	{
-		cl_int err;
-		std::ifstream f(fname);
-		if (!f.is_open())
-			return CL_INVALID_PROGRAM;
 
-		std::string str((std::istreambuf_iterator<char>(f)),
-				std::istreambuf_iterator<char>());
-		err = build_from_source(context, str.c_str());
-		f.close();
+	//! time spent in the queue before submission
+	cl_ulong queue_time () const { return submit - queued; }
 
-		return err;
-	}
+	//! time between submission and start of execution
+	cl_ulong submit_time () const { return start - submit; }
+
+	//! execution time
+	cl_ulong exec_time () const { return end - start; }
+
+	//! time from enqueueing to completion
+	cl_ulong total_time () const { return end - queued; }
 };
 
 
+struct Event;
+
+
 /**
- * struct Kernel - wrapping the cl_kernel object into some templated functions
- * to reduce direct OpenCL function invocation/typing.
- *
- * @k:			the contained cl_kernel object
- * @release_on_destroy:	determines if the contained cl_kernel object is released
- *			by clReleaseKernel when the cl::Kernel object is
- *			destroyed
+ * struct EventSlot - receives the event of an enqueued command for an Event.
+ * the Event only takes over the new handle when the slot is destroyed, that
+ * is after the enqueue call has returned, so the event it held before stays
+ * valid while it is in the wait list of that call
  */
-struct Kernel : CLObjContainer<cl_kernel, clReleaseKernel>
-		, CommandQueueJunction
+struct EventSlot
 {
-	/**
-	 * create a new kernel instance by passing the cl_kernel object to it.
-	 *
-	 * @kernel:		An existing cl_kernel object
-	 * @release_on_destroy:	Decide whether the contained cl_kernel object
-	 *			shall be released when cl::Kernel object is
-	 *			destroyed
-	 */
-	Kernel (cl_kernel kernel = NULL, bool release_on_destroy = true)
-		: CLObjContainer(kernel, release_on_destroy)
+	explicit
+	EventSlot (Event *target)
+		: target(target)
+		, event(NULL)
 	{}
 
 
-	/**
-	 * set one or many kernel arguments. consecutive calls to this function
-	 * might overwrite previously set arguments as the argument index is
-	 * deduced from argument count
-	 */
-	template <typename... Args>
-	cl_int
-	set_args (const Args&... args)
+	EventSlot (EventSlot &&other)
+		: target(other.target)
+		, event(other.event)
 	{
-		return set_kernel_args(this->cl_obj, args...);
+		other.target = NULL;
 	}
 
 
-	/**
-	 * set a specific kernel argument
-	 *
-	 * @n:		Argument index (starting by 0)
-	 * @arg:	Argument value
-	 */
+	EventSlot (const EventSlot &) = delete;
+	EventSlot& operator= (const EventSlot &) = delete;
+
+
+	~EventSlot ();
+
+
+	operator cl_event* ()
+	{
+		return target ? &event : NULL;
+	}
+
+
+private:
+	Event *target;
+	cl_event event;
+};
+
+
+/**
+ * struct Event - holds the event of an enqueued command.
+ *
+ * Functions that enqueue commands take an optional Event pointer. The new
+ * event handle replaces the held one once the enqueue call has returned, so
+ * the same Event can be reused for consecutive commands without leaking, even
+ * when its previous event is in the wait list of the next command.
+ * Dependencies between commands are expressed by passing events in an
+ * EventList to the next enqueue function.
+ */
+struct Event : CLObjContainer<cl_event, clReleaseEvent>
+{
+	Event (cl_event event = NULL, bool release_on_destroy = true)
+		: CLObjContainer(event, release_on_destroy)
+	{}
+
+
+	/**
+	 * get the location where an enqueue function shall store its event,
+	 * see EventSlot. converts to NULL when no event is requested
+	 */
+	static EventSlot
+	slot (Event *event)
+	{
+		return EventSlot(event);
+	}
+
+
+	/**
+	 * block until the command associated with the event has finished
+	 */
+	cl_int
+	wait () const
+	{
+		if (!this->cl_obj)
+			return CL_INVALID_EVENT;
+		return clWaitForEvents(1, &(this->cl_obj));
+	}
+
+
+	/**
+	 * get the execution status of the command. @status is one of
+	 * CL_QUEUED, CL_SUBMITTED, CL_RUNNING, CL_COMPLETE or a negative error
+	 * code if the command terminated abnormally
+	 */
+	cl_int
+	status (cl_int *status) const
+	{
+		return clGetEventInfo(this->cl_obj,
+				CL_EVENT_COMMAND_EXECUTION_STATUS,
+				sizeof(cl_int), status, NULL);
+	}
+
+
+	/**
+	 * check if the command has finished without blocking
+	 */
+	bool
+	complete () const
+	{
+		cl_int s;
+		return (status(&s) == CL_SUCCESS) && (s == CL_COMPLETE);
+	}
+
+
+	/**
+	 * register a callback which gets called when the command reaches
+	 * @type (currently only CL_COMPLETE is supported by OpenCL 1.1). the
+	 * callback receives the execution status and may be called from a
+	 * thread of the OpenCL implementation.
+	 */
+	cl_int
+	on_status (const std::function<void (cl_int)> &fn,
+			cl_int type = CL_COMPLETE)
+	{
+		if (!this->cl_obj)
+			return CL_INVALID_EVENT;
+
+		std::function<void (cl_int)> *f =
+			new std::function<void (cl_int)>(fn);
+		cl_int err = clSetEventCallback(this->cl_obj, type,
+				&Event::dispatch_callback, f);
+		if (err != CL_SUCCESS)
+			delete f;
+		return err;
+	}
+
+
+	/**
+	 * query a single profiling timestamp. the queue that executed the
+	 * command has to be created with CL_QUEUE_PROFILING_ENABLE, otherwise
+	 * CL_PROFILING_INFO_NOT_AVAILABLE is returned
+	 */
+	cl_int
+	profiling (cl_profiling_info param, cl_ulong *value) const
+	{
+		return clGetEventProfilingInfo(this->cl_obj, param,
+				sizeof(cl_ulong), value, NULL);
+	}
+
+
+	/**
+	 * query all profiling timestamps of the command. the command has to be
+	 * complete
+	 */
+	cl_int
+	times (EventTimes *t) const
+	{
+		cl_int err;
+		err = profiling(CL_PROFILING_COMMAND_QUEUED, &t->queued);
+		if (err == CL_SUCCESS)
+			err = profiling(CL_PROFILING_COMMAND_SUBMIT, &t->submit);
+		if (err == CL_SUCCESS)
+			err = profiling(CL_PROFILING_COMMAND_START, &t->start);
+		if (err == CL_SUCCESS)
+			err = profiling(CL_PROFILING_COMMAND_END, &t->end);
+		return err;
+	}
+
+
+private:
+	static void CL_CALLBACK
+	dispatch_callback (cl_event, cl_int status, void *data)
+	{
+		std::function<void (cl_int)> *f =
+			(std::function<void (cl_int)>*)data;
+		(*f)(status);
+		delete f;
+	}
+};
+
+
+inline
+EventSlot::~EventSlot ()
+{
+	if (target)
+		target->reset(event);
+}
+
+
+/**
+ * struct UserEvent - an event whose status is controlled by the host. can be
+ * put into wait lists to hold back a chain of commands until the host
+ * releases it with set_status()
+ */
+struct UserEvent : Event
+{
+	cl_int
+	create (const cl_context ctx)
+	{
+		cl_int err;
+		reset(clCreateUserEvent(ctx, &err));
+		return err;
+	}
+
+
+	cl_int
+	create (const Context &ctx)
+	{
+		return create(ctx());
+	}
+
+
+	cl_int
+	set_status (cl_int status = CL_COMPLETE)
+	{
+		return clSetUserEventStatus(this->cl_obj, status);
+	}
+};
+
+
+/**
+ * struct EventList - wait list for enqueue functions.
+ *
+ * The list only references the events, so the Event objects have to be alive
+ * when the list is passed to an enqueue function. Empty events are skipped,
+ * which makes it possible to pass an Event that was never used.
+ */
+struct EventList
+{
+	std::vector<cl_event> events;
+
+
+	EventList () {}
+
+
+	template <typename... Events>
+	EventList (const Event &event, const Events&... events)
+	{
+		add(event, events...);
+	}
+
+
+	EventList&
+	add ()
+	{
+		return *this;
+	}
+
+
+	template <typename... Events>
+	EventList&
+	add (const Event &event, const Events&... events)
+	{
+		return add(event(), events...);
+	}
+
+
+	template <typename... Events>
+	EventList&
+	add (cl_event event, const Events&... events)
+	{
+		if (event)
+			this->events.push_back(event);
+		return add(events...);
+	}
+
+
+	cl_uint
+	size () const
+	{
+		return (cl_uint)events.size();
+	}
+
+
+	const cl_event*
+	data () const
+	{
+		return events.empty() ? NULL : &events[0];
+	}
+
+
+	/**
+	 * block until all events in the list have finished
+	 */
+	cl_int
+	wait () const
+	{
+		if (events.empty())
+			return CL_SUCCESS;
+		return clWaitForEvents(size(), data());
+	}
+};
+
+
+/**
+ * struct Tracer - opt-in timeline of the commands enqueued through cl_0x.
+ *
+ * While tracing is enabled, Kernel::run, the Buffer transfer, copy, map and
+ * unmap functions and Program builds record the host time spent in the API
+ * call. Enqueued commands additionally get the profiling timestamps of their
+ * event once they complete, which requires queues created with
+ * CL_QUEUE_PROFILING_ENABLE. write_json() exports the records in the Chrome
+ * trace event format (chrome://tracing, ui.perfetto.dev) with host calls on
+ * one track per thread, device commands on one track per queue and a flow
+ * arrow from each call to its command.
+ *
+ * Tracing is enabled with enable() or by setting CL0X_TRACE to a file name,
+ * the trace is then written to that file at exit. Device clocks are not
+ * synchronized with the host, so the timestamps of a queue are shifted by the
+ * smallest difference between the end of an enqueue call and the queued
+ * timestamp of its command.
+ *
+ * @category:	"kernel", "transfer", "map" or "build"
+ * @thread:	index of the host thread in the order of first use
+ * @bytes:	size of a transfer, 0 for other commands
+ * @detail:	build options of a program build
+ * @host_begin,
+ * @host_end:	host time of the API call in ns since tracing started
+ * @device:	device timestamps, all 0 until the command completed
+ */
+struct Tracer
+{
+	struct Record
+	{
+		std::string name;
+		const char *category;
+		unsigned thread;
+		cl_command_queue queue;
+		size_t bytes;
+		std::string detail;
+		cl_long host_begin;
+		cl_long host_end;
+		EventTimes device;
+
+
+		Record ()
+			: category("")
+			, thread(0)
+			, queue(NULL)
+			, bytes(0)
+			, host_begin(0)
+			, host_end(0)
+		{}
+	};
+
+
+	/**
+	 * the tracer of the process. it is never destroyed, so completion
+	 * callbacks of the OpenCL runtime can not outlive it
+	 */
+	static Tracer&
+	instance ()
+	{
+		static Tracer *tracer = new Tracer();
+		return *tracer;
+	}
+
+
+	bool
+	active () const
+	{
+		return enabled.load(std::memory_order_relaxed);
+	}
+
+
+	void
+	enable ()
+	{
+		enabled = true;
+	}
+
+
+	void
+	disable ()
+	{
+		enabled = false;
+	}
+
+
+	//! drop all records, completions of commands in flight are ignored
+	void
+	clear ()
+	{
+		std::lock_guard<std::mutex> l(lock);
+		records.clear();
+		generation++;
+	}
+
+
+	size_t
+	size ()
+	{
+		std::lock_guard<std::mutex> l(lock);
+		return records.size();
+	}
+
+
+	//! ns since tracing started
+	cl_long
+	now () const
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - epoch).count();
+	}
+
+
+	//! index of the calling thread for the trace
+	unsigned
+	thread_index ()
+	{
+		thread_local unsigned index = next_thread++;
+		return index;
+	}
+
+
+	/**
+	 * name the track of queue @q in the trace, queues are called
+	 * "queue N" otherwise
+	 */
+	void
+	name_queue (cl_command_queue q, const std::string &name)
+	{
+		std::lock_guard<std::mutex> l(lock);
+		queue_names[q] = name;
+	}
+
+
+	/**
+	 * add a record. when @event is given, the device timestamps are filled
+	 * in once the command has completed
+	 */
+	void
+	record (Record &&r, cl_event event)
+	{
+		Completion *c = NULL;
+		{
+			std::lock_guard<std::mutex> l(lock);
+			if (event)
+				c = new Completion(this, generation,
+						records.size());
+			records.push_back(std::move(r));
+		}
+		if (!c)
+			return;
+
+		clRetainEvent(event);
+		if (clSetEventCallback(event, CL_COMPLETE, &Tracer::complete, c)
+				!= CL_SUCCESS) {
+			clReleaseEvent(event);
+			delete c;
+		}
+	}
+
+
+	//! copy of the records
+	std::vector<Record>
+	snapshot ()
+	{
+		std::lock_guard<std::mutex> l(lock);
+		return records;
+	}
+
+
+	/**
+	 * export the records in the Chrome trace event format
+	 */
+	std::string
+	json ()
+	{
+		std::vector<Record> recs;
+		std::map<cl_command_queue, std::string> names;
+		{
+			std::lock_guard<std::mutex> l(lock);
+			recs = records;
+			names = queue_names;
+		}
+
+		// track ids of the queues and their clock offsets
+		std::map<cl_command_queue, unsigned> tracks;
+		std::map<cl_command_queue, cl_long> offsets;
+		unsigned threads = 0;
+		for (size_t i = 0; i < recs.size(); i++) {
+			const Record &r = recs[i];
+			threads = std::max(threads, r.thread + 1);
+			if (!r.queue)
+				continue;
+			if (!tracks.count(r.queue)) {
+				unsigned n = (unsigned)tracks.size();
+				tracks[r.queue] = n;
+			}
+			if (!r.device.end)
+				continue;
+			cl_long off = r.host_end - (cl_long)r.device.queued;
+			std::map<cl_command_queue, cl_long>::iterator it =
+				offsets.find(r.queue);
+			if (it == offsets.end() || off < it->second)
+				offsets[r.queue] = off;
+		}
+
+		std::string out = "{\"traceEvents\":[\n";
+		out += "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+			"\"args\":{\"name\":\"host\"}},\n";
+		out += "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,"
+			"\"args\":{\"name\":\"device\"}}";
+		for (unsigned t = 0; t < threads; t++)
+			out += ",\n{\"name\":\"thread_name\",\"ph\":\"M\","
+				"\"pid\":1,\"tid\":" + std::to_string(t)
+				+ ",\"args\":{\"name\":\"thread "
+				+ std::to_string(t) + "\"}}";
+		for (std::map<cl_command_queue, unsigned>::iterator it =
+				tracks.begin(); it != tracks.end(); it++) {
+			std::string name = names.count(it->first)
+				? names[it->first]
+				: "queue " + std::to_string(it->second);
+			out += ",\n{\"name\":\"thread_name\",\"ph\":\"M\","
+				"\"pid\":2,\"tid\":"
+				+ std::to_string(it->second)
+				+ ",\"args\":{\"name\":";
+			json_string(&out, name);
+			out += "}}";
+		}
+
+		for (size_t i = 0; i < recs.size(); i++) {
+			const Record &r = recs[i];
+			std::string common = ",\"cat\":\"";
+			common += r.category;
+			common += "\",\"name\":";
+			json_string(&common, r.name);
+
+			std::string args;
+			if (r.queue) {
+				args += ",\"queue\":";
+				json_string(&args, names.count(r.queue)
+					? names[r.queue]
+					: "queue " + std::to_string(
+						tracks[r.queue]));
+			}
+			if (r.bytes)
+				args += ",\"bytes\":" + std::to_string(r.bytes);
+			if (!r.detail.empty()) {
+				args += ",\"detail\":";
+				json_string(&args, r.detail);
+			}
+			if (!args.empty())
+				args[0] = '{';
+			else
+				args = "{";
+			args += "}";
+
+			out += ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":"
+				+ std::to_string(r.thread) + ",\"ts\":"
+				+ usec(r.host_begin) + ",\"dur\":"
+				+ usec(r.host_end - r.host_begin) + common
+				+ ",\"args\":" + args + "}";
+
+			if (!r.queue || !r.device.end)
+				continue;
+
+			const cl_long off = offsets[r.queue];
+			const std::string tid = std::to_string(tracks[r.queue]);
+			const std::string id = std::to_string(i);
+			out += ",\n{\"ph\":\"X\",\"pid\":2,\"tid\":" + tid
+				+ ",\"ts\":"
+				+ usec((cl_long)r.device.start + off)
+				+ ",\"dur\":" + usec(r.device.exec_time())
+				+ common + ",\"args\":{\"queued_us\":"
+				+ usec(r.device.queue_time())
+				+ ",\"submitted_us\":"
+				+ usec(r.device.submit_time()) + "}}";
+
+			// flow arrow from the API call to the command
+			out += ",\n{\"ph\":\"s\",\"id\":" + id
+				+ ",\"pid\":1,\"tid\":"
+				+ std::to_string(r.thread) + ",\"ts\":"
+				+ usec(r.host_begin) + common + "}";
+			out += ",\n{\"ph\":\"f\",\"bp\":\"e\",\"id\":" + id
+				+ ",\"pid\":2,\"tid\":" + tid + ",\"ts\":"
+				+ usec((cl_long)r.device.start + off)
+				+ common + "}";
+		}
+		out += "\n]}\n";
+		return out;
+	}
+
+
+	/**
+	 * write the trace to @fname, see json()
+	 */
+	cl_int
+	write_json (const char *fname)
+	{
+		FILE *f = fopen(fname, "wb");
+		if (!f)
+			return CL_INVALID_VALUE;
+
+		std::string s = json();
+		bool ok = fwrite(s.data(), 1, s.size(), f) == s.size();
+		ok = (fclose(f) == 0) && ok;
+		return ok ? CL_SUCCESS : CL_OUT_OF_HOST_MEMORY;
+	}
+
+
+private:
+	//! identifies the record a completion callback belongs to
+	struct Completion
+	{
+		Tracer *tracer;
+		unsigned generation;
+		size_t index;
+
+		Completion (Tracer *tracer, unsigned generation, size_t index)
+			: tracer(tracer)
+			, generation(generation)
+			, index(index)
+		{}
+	};
+
+
+	std::atomic<bool> enabled;
+	std::atomic<unsigned> next_thread;
+	std::chrono::steady_clock::time_point epoch;
+	std::mutex lock;
+	std::vector<Record> records;
+	std::map<cl_command_queue, std::string> queue_names;
+	unsigned generation;
+	std::string path;
+
+
+	Tracer ()
+		: enabled(false)
+		, next_thread(0)
+		, epoch(std::chrono::steady_clock::now())
+		, generation(0)
+	{
+		const char *p = getenv("CL0X_TRACE");
+		if (p && *p) {
+			path = p;
+			enabled = true;
+			atexit(&Tracer::write_at_exit);
+		}
+	}
+
+
+	static void
+	write_at_exit ()
+	{
+		Tracer &t = instance();
+		t.disable();
+		if (t.write_json(t.path.c_str()) != CL_SUCCESS)
+			fprintf(stderr, "cl_0x: could not write trace to %s\n",
+					t.path.c_str());
+	}
+
+
+	static void CL_CALLBACK
+	complete (cl_event event, cl_int status, void *data)
+	{
+		Completion *c = (Completion*)data;
+		Event e(event, false);
+		EventTimes t;
+		if (status == CL_COMPLETE && e.times(&t) == CL_SUCCESS) {
+			std::lock_guard<std::mutex> l(c->tracer->lock);
+			if (c->generation == c->tracer->generation
+			    && c->index < c->tracer->records.size())
+				c->tracer->records[c->index].device = t;
+		}
+		clReleaseEvent(event);
+		delete c;
+	}
+
+
+	static std::string
+	usec (cl_long ns)
+	{
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%.3f", ns / 1000.0);
+		return buf;
+	}
+
+
+	static void
+	json_string (std::string *out, const std::string &s)
+	{
+		*out += '"';
+		for (size_t i = 0; i < s.size(); i++) {
+			unsigned char c = s[i];
+			if (c == '"' || c == '\\') {
+				*out += '\\';
+				*out += (char)c;
+			} else if (c < 0x20) {
+				char buf[8];
+				snprintf(buf, sizeof(buf), "\\u%04x", c);
+				*out += buf;
+			} else {
+				*out += (char)c;
+			}
+		}
+		*out += '"';
+	}
+};
+
+
+/**
+ * struct TraceScope - records the enclosing API call while tracing is
+ * enabled. the enqueue function has to store its event in event(). while
+ * tracing, this is a temporary event for the device timestamps that is
+ * handed to the caller's slot when the scope ends, so the slot is only
+ * written once the enqueue has succeeded. commands without a queue
+ * (program builds) get no event
+ */
+struct TraceScope
+{
+	TraceScope (const char *category, const char *name,
+			cl_command_queue q = NULL, cl_event *event = NULL,
+			size_t bytes = 0)
+		: active(Tracer::instance().active())
+		, slot(event)
+		, local(NULL)
+		, target(event)
+	{
+		if (!active)
+			return;
+
+		Tracer &t = Tracer::instance();
+		if (slot || q)
+			target = &local;
+		rec.name = name;
+		rec.category = category;
+		rec.thread = t.thread_index();
+		rec.queue = q;
+		rec.bytes = bytes;
+		rec.host_begin = t.now();
+	}
+
+
+	TraceScope (const TraceScope &) = delete;
+	TraceScope& operator= (const TraceScope &) = delete;
+
+
+	~TraceScope ()
+	{
+		if (!active)
+			return;
+
+		// the enqueue only stores an event when it succeeds
+		Tracer &t = Tracer::instance();
+		rec.host_end = t.now();
+		t.record(std::move(rec), local);
+		if (local && slot)
+			*slot = local;
+		else if (local)
+			clReleaseEvent(local);
+	}
+
+
+	cl_event*
+	event ()
+	{
+		return target;
+	}
+
+
+	//! name the record after the function name of @kernel
+	void
+	kernel (cl_kernel kernel)
+	{
+		char name[256];
+		if (active && clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME,
+					sizeof(name), name, NULL) == CL_SUCCESS)
+			rec.name = name;
+	}
+
+
+	void
+	detail (const char *s)
+	{
+		if (active && s)
+			rec.detail = s;
+	}
+
+
+private:
+	bool active;
+	cl_event *slot;
+	cl_event local;
+	cl_event *target;
+	Tracer::Record rec;
+};
+
+
+/**
+ * 64bit FNV-1a hash. pass the result of a previous call as @h to chain several
+ * inputs into one hash value
+ */
+inline cl_ulong
+fnv1a (const void *data, size_t len, cl_ulong h = 0xcbf29ce484222325ULL)
+{
+	const unsigned char *p = (const unsigned char*)data;
+	for (size_t i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+
+inline cl_ulong
+fnv1a (const std::string &str, cl_ulong h = 0xcbf29ce484222325ULL)
+{
+	// hash the terminating zero as well to separate consecutive strings
+	return fnv1a(str.c_str(), str.size() + 1, h);
+}
+
+
+/**
+ * name for a temporary file next to @fname that no other process or thread
+ * uses at the same time, to write @fname atomically by renaming it
+ */
+inline std::string
+temp_name (const std::string &fname)
+{
+	static std::atomic<unsigned> counter(0);
+	unsigned long long pid = 0;
+#if defined(__unix__) || defined(__APPLE__)
+	pid = getpid();
+#endif
+	char suffix[64];
+	snprintf(suffix, sizeof(suffix), ".%llu.%llx.%u.tmp", pid,
+			(unsigned long long)std::hash<std::thread::id>()(
+				std::this_thread::get_id()),
+			counter++);
+	return fname + suffix;
+}
+
+
+/**
+ * get all devices that are associated with a context
+ */
+inline cl_int
+context_devices (cl_context ctx, std::vector<cl_device_id> &devices)
+{
+	cl_int err;
+	size_t len = 0;
+
+	err = clGetContextInfo(ctx, CL_CONTEXT_DEVICES, 0, NULL, &len);
+	if (err != CL_SUCCESS)
+		return err;
+	if (len < sizeof(cl_device_id))
+		return CL_INVALID_CONTEXT;
+
+	devices.resize(len / sizeof(cl_device_id));
+	return clGetContextInfo(ctx, CL_CONTEXT_DEVICES, len, &devices[0],
+			NULL);
+}
+
+
+/**
+ * get the build logs of all devices of a program. every non-empty log is
+ * preceded by the name of its device
+ */
+inline cl_int
+program_build_log (cl_program prog, std::string *log)
+{
+	cl_int err;
+	cl_uint ndevices = 0;
+
+	log->clear();
+	err = clGetProgramInfo(prog, CL_PROGRAM_NUM_DEVICES, sizeof(ndevices),
+			&ndevices, NULL);
+	if (err != CL_SUCCESS)
+		return err;
+	if (!ndevices)
+		return CL_SUCCESS;
+
+	std::vector<cl_device_id> devices(ndevices);
+	err = clGetProgramInfo(prog, CL_PROGRAM_DEVICES,
+			sizeof(cl_device_id) * ndevices, &devices[0], NULL);
+	if (err != CL_SUCCESS)
+		return err;
+
+	for (cl_uint i = 0; i < ndevices; i++) {
+		size_t len = 0;
+		err = clGetProgramBuildInfo(prog, devices[i],
+				CL_PROGRAM_BUILD_LOG, 0, NULL, &len);
+		if (err != CL_SUCCESS)
+			return err;
+		if (len <= 1)
+			continue;
+
+		std::vector<char> buf(len);
+		err = clGetProgramBuildInfo(prog, devices[i],
+				CL_PROGRAM_BUILD_LOG, len, &buf[0], NULL);
+		if (err != CL_SUCCESS)
+			return err;
+		*log += device_info_string(devices[i], CL_DEVICE_NAME) + ":\n";
+		*log += &buf[0];
+		if (log->empty() || (*log)[log->size() - 1] != '\n')
+			*log += '\n';
+	}
+	return CL_SUCCESS;
+}
+
+
+/**
+ * check the build status of a program on all of its devices. returns
+ * CL_BUILD_PROGRAM_FAILURE if the build failed on any device
+ */
+inline cl_int
+program_build_status (cl_program prog)
+{
+	cl_int err;
+	cl_uint ndevices = 0;
+
+	err = clGetProgramInfo(prog, CL_PROGRAM_NUM_DEVICES, sizeof(ndevices),
+			&ndevices, NULL);
+	if (err != CL_SUCCESS)
+		return err;
+	if (!ndevices)
+		return CL_BUILD_PROGRAM_FAILURE;
+
+	std::vector<cl_device_id> devices(ndevices);
+	err = clGetProgramInfo(prog, CL_PROGRAM_DEVICES,
+			sizeof(cl_device_id) * ndevices, &devices[0], NULL);
+	if (err != CL_SUCCESS)
+		return err;
+
+	for (cl_uint i = 0; i < ndevices; i++) {
+		cl_build_status status = CL_BUILD_NONE;
+		err = clGetProgramBuildInfo(prog, devices[i],
+				CL_PROGRAM_BUILD_STATUS, sizeof(status),
+				&status, NULL);
+		if (err != CL_SUCCESS)
+			return err;
+		if (status != CL_BUILD_SUCCESS)
+			return CL_BUILD_PROGRAM_FAILURE;
+	}
+	return CL_SUCCESS;
+}
+
+
+/**
+ * struct ThreadPool - a fixed number of worker threads executing submitted
+ * tasks in FIFO order.
+ *
+ * A pool without threads (before create() or after stop()) runs submitted
+ * tasks immediately in the calling thread. stop() and the destructor finish
+ * all queued tasks before joining the workers.
+ */
+struct ThreadPool
+{
+	std::mutex lock;
+	std::condition_variable wake;
+	std::deque<std::function<void ()>> tasks;
+	std::vector<std::thread> threads;
+	bool stopping;
+
+
+	ThreadPool ()
+		: stopping(false)
+	{}
+
+
+	ThreadPool (const ThreadPool &) = delete;
+	ThreadPool& operator= (const ThreadPool &) = delete;
+
+
+	~ThreadPool ()
+	{
+		stop();
+	}
+
+
+	/**
+	 * start @nthreads workers, one per hardware thread if @nthreads is 0
+	 */
+	cl_int
+	create (unsigned nthreads = 0)
+	{
+		stop();
+		if (!nthreads)
+			nthreads = std::thread::hardware_concurrency();
+		if (!nthreads)
+			nthreads = 1;
+
+		stopping = false;
+		try {
+			for (unsigned i = 0; i < nthreads; i++)
+				threads.push_back(std::thread(
+					&ThreadPool::work, this));
+		} catch (const std::system_error &) {
+			stop();
+			return CL_OUT_OF_HOST_MEMORY;
+		}
+		return CL_SUCCESS;
+	}
+
+
+	size_t
+	size () const
+	{
+		return threads.size();
+	}
+
+
+	void
+	submit (std::function<void ()> task)
+	{
+		if (threads.empty()) {
+			task();
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			tasks.push_back(std::move(task));
+		}
+		wake.notify_one();
+	}
+
+
+	/**
+	 * run @f on the pool and get its result through a future
+	 */
+	template <typename F>
+	std::future<typename std::result_of<F ()>::type>
+	async (F f)
+	{
+		typedef typename std::result_of<F ()>::type R;
+		std::shared_ptr<std::packaged_task<R ()>> task =
+			std::make_shared<std::packaged_task<R ()>>(f);
+		std::future<R> result = task->get_future();
+		submit([task]() { (*task)(); });
+		return result;
+	}
+
+
+	/**
+	 * run all queued tasks and join the workers
+	 */
+	void
+	stop ()
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (size_t i = 0; i < threads.size(); i++)
+			threads[i].join();
+		threads.clear();
+	}
+
+
+private:
+	void
+	work ()
+	{
+		for (;;) {
+			std::function<void ()> task;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				wake.wait(guard, [this]() {
+					return stopping || !tasks.empty();
+				});
+				if (tasks.empty())
+					return;
+				task = std::move(tasks.front());
+				tasks.pop_front();
+			}
+			task();
+		}
+	}
+};
+
+
+/**
+ * struct WorkStealingPool - worker threads with one task queue each.
+ *
+ * Tasks submitted by a worker go to its own queue, tasks submitted by other
+ * threads are spread over the queues round-robin. A worker takes the newest
+ * task of its own queue and steals the oldest task of another queue when its
+ * own queue is empty, so there is no lock shared by all submitters. Tasks
+ * get the index of the worker that runs them. There is no ordering between
+ * tasks.
+ *
+ * A pool without threads runs submitted tasks immediately in the calling
+ * thread as worker 0. stop() and the destructor finish all queued tasks
+ * before joining the workers.
+ */
+struct WorkStealingPool
+{
+	typedef std::function<void (unsigned)> task_type;
+
+	struct Queue
+	{
+		std::mutex lock;
+		std::deque<task_type> tasks;
+	};
+
+
+	std::vector<std::unique_ptr<Queue>> queues;
+	std::vector<std::thread> threads;
+	std::atomic<unsigned> next;
+	std::atomic<size_t> pending;
+	std::atomic<unsigned> sleepers;
+	std::atomic<bool> stopping;
+
+	//! only taken by workers that go to sleep and to wake them up
+	std::mutex sleep_lock;
+	std::condition_variable wake;
+
+
+	WorkStealingPool ()
+		: next(0)
+		, pending(0)
+		, sleepers(0)
+		, stopping(false)
+	{}
+
+
+	WorkStealingPool (const WorkStealingPool &) = delete;
+	WorkStealingPool& operator= (const WorkStealingPool &) = delete;
+
+
+	~WorkStealingPool ()
+	{
+		stop();
+	}
+
+
+	/**
+	 * start @nthreads workers, one per hardware thread if @nthreads is 0
+	 */
+	cl_int
+	create (unsigned nthreads = 0)
+	{
+		stop();
+		if (!nthreads)
+			nthreads = std::thread::hardware_concurrency();
+		if (!nthreads)
+			nthreads = 1;
+
+		stopping = false;
+		for (unsigned i = 0; i < nthreads; i++)
+			queues.push_back(std::unique_ptr<Queue>(new Queue));
+		try {
+			for (unsigned i = 0; i < nthreads; i++)
+				threads.push_back(std::thread(
+					&WorkStealingPool::work, this, i));
+		} catch (const std::system_error &) {
+			stop();
+			return CL_OUT_OF_HOST_MEMORY;
+		}
+		return CL_SUCCESS;
+	}
+
+
+	size_t
+	size () const
+	{
+		return threads.size();
+	}
+
+
+	void
+	submit (task_type task)
+	{
+		if (threads.empty()) {
+			task(0);
+			return;
+		}
+
+		unsigned i;
+		if (current_pool() == this)
+			i = current_worker();
+		else
+			i = next++ % queues.size();
+
+		// count the task before it can be taken, so that pending never
+		// drops below the number of queued tasks
+		pending++;
+		{
+			std::lock_guard<std::mutex> guard(queues[i]->lock);
+			queues[i]->tasks.push_back(std::move(task));
+		}
+		if (sleepers.load()) {
+			{ std::lock_guard<std::mutex> guard(sleep_lock); }
+			wake.notify_one();
+		}
+	}
+
+
+	/**
+	 * run @f on the pool and get its result through a future. @f is called
+	 * with the index of the worker
+	 */
+	template <typename F>
+	std::future<typename std::result_of<F (unsigned)>::type>
+	async (F f)
+	{
+		typedef typename std::result_of<F (unsigned)>::type R;
+		std::shared_ptr<std::packaged_task<R (unsigned)>> task =
+			std::make_shared<std::packaged_task<R (unsigned)>>(f);
+		std::future<R> result = task->get_future();
+		submit([task](unsigned i) { (*task)(i); });
+		return result;
+	}
+
+
+	/**
+	 * run all queued tasks and join the workers
+	 */
+	void
+	stop ()
+	{
+		{
+			std::lock_guard<std::mutex> guard(sleep_lock);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (size_t i = 0; i < threads.size(); i++)
+			threads[i].join();
+		threads.clear();
+		queues.clear();
+	}
+
+
+private:
+	static const WorkStealingPool*&
+	current_pool ()
+	{
+		static thread_local const WorkStealingPool *pool = NULL;
+		return pool;
+	}
+
+
+	static unsigned&
+	current_worker ()
+	{
+		static thread_local unsigned worker = 0;
+		return worker;
+	}
+
+
+	bool
+	take (unsigned self, task_type &task)
+	{
+		// newest task of the own queue, its data is likely still cached
+		{
+			Queue &q = *queues[self];
+			std::lock_guard<std::mutex> guard(q.lock);
+			if (!q.tasks.empty()) {
+				task = std::move(q.tasks.back());
+				q.tasks.pop_back();
+				pending--;
+				return true;
+			}
+		}
+
+		// oldest task of another queue
+		for (size_t k = 1; k < queues.size(); k++) {
+			Queue &q = *queues[(self + k) % queues.size()];
+			std::lock_guard<std::mutex> guard(q.lock);
+			if (!q.tasks.empty()) {
+				task = std::move(q.tasks.front());
+				q.tasks.pop_front();
+				pending--;
+				return true;
+			}
+		}
+		return false;
+	}
+
+
+	void
+	work (unsigned self)
+	{
+		current_pool() = this;
+		current_worker() = self;
+
+		for (;;) {
+			task_type task;
+			if (take(self, task)) {
+				task(self);
+				continue;
+			}
+
+			std::unique_lock<std::mutex> guard(sleep_lock);
+			if (stopping && !pending)
+				break;
+			sleepers++;
+			wake.wait(guard, [this]() {
+				return pending.load() || stopping.load();
+			});
+			sleepers--;
+		}
+
+		current_pool() = NULL;
+	}
+};
+
+
+/**
+ * struct ProgramCache - on-disk cache for program binaries.
+ *
+ * Entries are keyed by a hash of the program source, the build options and
+ * the identity (name, vendor, driver and OpenCL version) of every device in
+ * the context. A driver update therefore results in a cache miss instead of
+ * loading an outdated binary. Entries that can not be read or that are
+ * rejected by the runtime are removed and the program is rebuilt from source.
+ *
+ * To warm the cache during deployment, call warm() (or build the programs
+ * once with a cache attached) on the target machine.
+ *
+ * @dir:	directory to store the binaries in. The directory has to exist.
+ *		Defaults to $CL0X_CACHE_DIR or the current working directory.
+ */
+struct ProgramCache
+{
+	std::string dir;
+
+
+	explicit
+	ProgramCache (const char *dir = NULL)
+		: dir(dir ? dir : default_dir())
+	{}
+
+
+	static const char*
+	default_dir ()
+	{
+		const char *d = getenv("CL0X_CACHE_DIR");
+		return d ? d : ".";
+	}
+
+
+	/**
+	 * compute the cache key of a program built from @src with @options for
+	 * all devices of @ctx
+	 */
+	cl_int
+	key (cl_context ctx, const char *src, const char *options,
+			cl_ulong *key) const
+	{
+		std::vector<cl_device_id> devices;
+		cl_int err = context_devices(ctx, devices);
+		if (err != CL_SUCCESS)
+			return err;
+
+		cl_ulong h = fnv1a(std::string(src));
+		h = fnv1a(std::string(options ? options : ""), h);
+		for (size_t i = 0; i < devices.size(); i++) {
+			cl_device_id d = devices[i];
+			h = fnv1a(device_info_string(d, CL_DEVICE_NAME), h);
+			h = fnv1a(device_info_string(d, CL_DEVICE_VENDOR), h);
+			h = fnv1a(device_info_string(d, CL_DRIVER_VERSION), h);
+			h = fnv1a(device_info_string(d, CL_DEVICE_VERSION), h);
+		}
+		*key = h;
+		return CL_SUCCESS;
+	}
+
+
+	std::string
+	path (cl_ulong key) const
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "/%016llx.clbin",
+				(unsigned long long)key);
+		return dir + name;
+	}
+
+
+	/**
+	 * create and build a program from a cached binary. returns
+	 * CL_INVALID_BINARY when there is no valid entry for @key
+	 */
+	cl_int
+	load (cl_context ctx, cl_ulong key, const char *options,
+			cl_program *prog) const
+	{
+		std::vector<cl_device_id> devices;
+		cl_int err = context_devices(ctx, devices);
+		if (err != CL_SUCCESS)
+			return err;
+
+		std::ifstream f(path(key).c_str(), std::ios::binary);
+		if (!f.is_open())
+			return CL_INVALID_BINARY;
+
+		char magic[8];
+		cl_ulong k = 0;
+		cl_uint ndevices = 0;
+		f.read(magic, sizeof(magic));
+		f.read((char*)&k, sizeof(k));
+		f.read((char*)&ndevices, sizeof(ndevices));
+		if (!f || memcmp(magic, "CL0XBIN1", 8) || k != key
+		    || ndevices != devices.size())
+			return CL_INVALID_BINARY;
+
+		// a damaged length must not make us allocate more than the file
+		// holds
+		std::streampos pos = f.tellg();
+		f.seekg(0, std::ios::end);
+		std::streamoff left = f.tellg() - pos;
+		f.seekg(pos);
+		if (!f)
+			return CL_INVALID_BINARY;
+
+		std::vector<size_t> sizes(ndevices);
+		std::vector<std::vector<unsigned char>> bins(ndevices);
+		std::vector<const unsigned char*> ptrs(ndevices);
+		for (cl_uint i = 0; i < ndevices; i++) {
+			cl_ulong len = 0;
+			f.read((char*)&len, sizeof(len));
+			left -= sizeof(len);
+			if (!f || !len || len > (cl_ulong)left)
+				return CL_INVALID_BINARY;
+			left -= len;
+
+			bins[i].resize(len);
+			f.read((char*)&bins[i][0], len);
+			if (!f)
+				return CL_INVALID_BINARY;
+			sizes[i] = len;
+			ptrs[i] = &bins[i][0];
+		}
+
+		std::vector<cl_int> status(ndevices);
+		cl_program p = clCreateProgramWithBinary(ctx, ndevices,
+				&devices[0], &sizes[0], &ptrs[0], &status[0],
+				&err);
+		if (err != CL_SUCCESS)
+			return CL_INVALID_BINARY;
+
+		for (cl_uint i = 0; i < ndevices; i++)
+			if (status[i] != CL_SUCCESS)
+				err = CL_INVALID_BINARY;
+		if (err == CL_SUCCESS)
+			err = clBuildProgram(p, 0, NULL, options, NULL, NULL);
+		if (err != CL_SUCCESS) {
+			clReleaseProgram(p);
+			return CL_INVALID_BINARY;
+		}
+
+		*prog = p;
+		return CL_SUCCESS;
+	}
+
+
+	/**
+	 * write the binaries of a built program to the cache
+	 */
+	cl_int
+	store (cl_program prog, cl_ulong key) const
+	{
+		cl_int err;
+		cl_uint ndevices = 0;
+
+		err = clGetProgramInfo(prog, CL_PROGRAM_NUM_DEVICES,
+				sizeof(ndevices), &ndevices, NULL);
+		if (err != CL_SUCCESS)
+			return err;
+		if (!ndevices)
+			return CL_INVALID_PROGRAM_EXECUTABLE;
+
+		std::vector<size_t> sizes(ndevices);
+		err = clGetProgramInfo(prog, CL_PROGRAM_BINARY_SIZES,
+				sizeof(size_t) * ndevices, &sizes[0], NULL);
+		if (err != CL_SUCCESS)
+			return err;
+
+		std::vector<std::vector<unsigned char>> bins(ndevices);
+		std::vector<unsigned char*> ptrs(ndevices);
+		for (cl_uint i = 0; i < ndevices; i++) {
+			if (!sizes[i])
+				return CL_INVALID_PROGRAM_EXECUTABLE;
+			bins[i].resize(sizes[i]);
+			ptrs[i] = &bins[i][0];
+		}
+		err = clGetProgramInfo(prog, CL_PROGRAM_BINARIES,
+				sizeof(unsigned char*) * ndevices, &ptrs[0], NULL);
+		if (err != CL_SUCCESS)
+			return err;
+
+		// write to a temporary file first so that concurrent readers
+		// never see a partially written entry
+		std::string fname = path(key);
+		std::string tmpname = temp_name(fname);
+		std::ofstream f(tmpname.c_str(),
+				std::ios::binary | std::ios::trunc);
+		if (!f.is_open())
+			return CL_INVALID_VALUE;
+
+		f.write("CL0XBIN1", 8);
+		f.write((const char*)&key, sizeof(key));
+		f.write((const char*)&ndevices, sizeof(ndevices));
+		for (cl_uint i = 0; i < ndevices; i++) {
+			cl_ulong len = sizes[i];
+			f.write((const char*)&len, sizeof(len));
+			f.write((const char*)ptrs[i], len);
+		}
+		f.close();
+		if (!f || std::rename(tmpname.c_str(), fname.c_str())) {
+			std::remove(tmpname.c_str());
+			return CL_INVALID_VALUE;
+		}
+		return CL_SUCCESS;
+	}
+
+
+	/**
+	 * remove an entry from the cache
+	 */
+	void
+	evict (cl_ulong key) const
+	{
+		std::remove(path(key).c_str());
+	}
+
+
+	/**
+	 * get a program either from the cache or by building it from source.
+	 * freshly built programs are stored in the cache. failing to store a
+	 * program is not an error. when the build fails, the build log is
+	 * stored in @log if given
+	 */
+	cl_int
+	build (cl_context ctx, const char *src, const char *options,
+			cl_program *prog, std::string *log = NULL) const
+	{
+		cl_int err;
+		cl_ulong k;
+
+		err = key(ctx, src, options, &k);
+		if (err != CL_SUCCESS)
+			return err;
+		if (load(ctx, k, options, prog) == CL_SUCCESS)
+			return CL_SUCCESS;
+		evict(k);
+
+		size_t len[] = {strlen(src)};
+		cl_program p = clCreateProgramWithSource(ctx, 1, &src, len, &err);
+		if (err != CL_SUCCESS)
+			return err;
+
+		err = clBuildProgram(p, 0, NULL, options, NULL, NULL);
+		if (err != CL_SUCCESS) {
+			if (log)
+				program_build_log(p, log);
+			clReleaseProgram(p);
+			return err;
+		}
+
+		store(p, k);
+		*prog = p;
+		return CL_SUCCESS;
+	}
+
+
+	/**
+	 * build a program and store it in the cache without keeping it, e.g.
+	 * to populate the cache during deployment
+	 */
+	cl_int
+	warm (cl_context ctx, const char *src, const char *options = NULL) const
+	{
+		cl_program p;
+		cl_int err = build(ctx, src, options, &p);
+		if (err == CL_SUCCESS)
+			clReleaseProgram(p);
+		return err;
+	}
+};
+
+
+/**
+ * struct BuildOptions - compile-time specialization of a program.
+ *
+ * Host-side parameters are turned into build options (-D defines and
+ * compiler flags) and into a prelude that is put in front of the program
+ * source. Types go to the prelude as typedefs together with the extension
+ * pragma they need, because type names can not be passed reliably as a
+ * define (e.g. double requires cl_khr_fp64 to be enabled in the source).
+ *
+ *	BuildOptions opts;
+ *	opts.type<cl_float>("real")
+ *	    .define("VECTOR_WIDTH", 4)
+ *	    .define("UNROLL", 8)
+ *	    .flag("-cl-fast-relaxed-math");
+ *
+ * @options:	options passed to clBuildProgram
+ * @prelude:	source text put in front of the program source
+ */
+struct BuildOptions
+{
+	std::string options;
+	std::string prelude;
+
+
+	BuildOptions&
+	flag (const char *flag)
+	{
+		if (!options.empty())
+			options += ' ';
+		options += flag;
+		return *this;
+	}
+
+
+	BuildOptions&
+	define (const char *name)
+	{
+		return flag((std::string("-D ") + name).c_str());
+	}
+
+
+	/**
+	 * define @name to @value. the value must not contain white space, put
+	 * anything more complicated into the prelude
+	 */
+	BuildOptions&
+	define (const char *name, const char *value)
+	{
+		return flag((std::string("-D ") + name + "=" + value).c_str());
+	}
+
+
+	BuildOptions&
+	define (const char *name, const std::string &value)
+	{
+		return define(name, value.c_str());
+	}
+
+
+	template <typename T>
+	typename std::enable_if<std::is_integral<T>::value, BuildOptions&>::type
+	define (const char *name, T value)
+	{
+		return define(name, std::to_string(value));
+	}
+
+
+	/**
+	 * floating point values are written as hexadecimal literals so that the
+	 * kernel sees exactly the host value
+	 */
+	template <typename T>
+	typename std::enable_if<std::is_floating_point<T>::value,
+		 BuildOptions&>::type
+	define (const char *name, T value)
+	{
+		char buf[64];
+		if (std::isnan(value))
+			return define(name, "NAN");
+		if (std::isinf(value))
+			return define(name, value < 0 ? "-INFINITY" : "INFINITY");
+		snprintf(buf, sizeof(buf), "%a%s", (double)value,
+				sizeof(T) == sizeof(cl_float) ? "f" : "");
+		return define(name, buf);
+	}
+
+
+	/**
+	 * make @name an alias of the OpenCL C counterpart of @T
+	 */
+	template <typename T>
+	BuildOptions&
+	type (const char *name)
+	{
+		const char *pragma = CLTypeName<T>::pragma();
+		if (*pragma && prelude.find(pragma) == std::string::npos)
+			prelude = pragma + prelude;
+		prelude += std::string("typedef ") + CLTypeName<T>::name() + " "
+			+ name + ";\n";
+		return *this;
+	}
+
+
+	/**
+	 * append arbitrary source text to the prelude
+	 */
+	BuildOptions&
+	source (const std::string &text)
+	{
+		prelude += text;
+		if (!text.empty() && text[text.size() - 1] != '\n')
+			prelude += '\n';
+		return *this;
+	}
+
+
+	/**
+	 * identifies the specialization, equal keys result in equal programs
+	 * for the same source
+	 */
+	std::string
+	key () const
+	{
+		return prelude + '\0' + options;
+	}
+};
+
+
+/**
+ * struct Program - a program object built from source.
+ *
+ * Programs can be built synchronously, asynchronously by the OpenCL runtime
+ * (build_async() without a pool) or on a ThreadPool to build several
+ * programs concurrently. Destroying, moving, resetting or rebuilding a
+ * program waits for a pending asynchronous build to finish first.
+ *
+ * @log:	build log of the last failed build, empty otherwise
+ */
+struct Program : CLObjContainer<cl_program, clReleaseProgram>
+		 , ContextJunction
+{
+	/**
+	 * state of an asynchronous build, shared with the notification
+	 * callback. the first one to finish the build fulfils the promise
+	 */
+	struct AsyncBuild
+	{
+		std::string *log;
+		std::promise<cl_int> promise;
+		std::atomic<bool> done;
+		std::unique_ptr<TraceScope> trace;
+		std::mutex lock;
+		std::condition_variable finished;
+		bool complete;
+
+
+		explicit
+		AsyncBuild (std::string *log, const char *options = NULL)
+			: log(log)
+			, done(false)
+			, complete(false)
+		{
+			if (!Tracer::instance().active())
+				return;
+			trace.reset(new TraceScope("build", "build_async"));
+			trace->detail(options);
+		}
+
+
+		void
+		finish (cl_program prog, cl_int err)
+		{
+			if (done.exchange(true))
+				return;
+			trace.reset();
+			if (err != CL_SUCCESS && prog)
+				program_build_log(prog, log);
+			promise.set_value(err);
+
+			// notify under the lock, wait() may destroy the build
+			// as soon as it can take the lock
+			std::lock_guard<std::mutex> l(lock);
+			complete = true;
+			finished.notify_all();
+		}
+
+
+		void
+		wait ()
+		{
+			std::unique_lock<std::mutex> l(lock);
+			finished.wait(l, [this]() { return complete; });
+		}
+	};
+
+
+	std::string log;
+	std::unique_ptr<AsyncBuild> pending;
+
+
+	Program () {}
+
+
+	Program (Program &&other)
+		: Program()
+	{
+		*this = std::move(other);
+	}
+
+
+	Program&
+	operator= (Program &&other)
+	{
+		if (this != &other) {
+			settle();
+			other.settle();
+			container_type::operator=(std::move(other));
+			ContextJunction::operator=(other);
+			log = std::move(other.log);
+		}
+		return *this;
+	}
+
+
+	~Program ()
+	{
+		settle();
+	}
+
+
+	void
+	reset (cl_program cl_obj = NULL, bool release_on_destroy = true)
+	{
+		settle();
+		container_type::reset(cl_obj, release_on_destroy);
+	}
+
+
+	/**
+	 * build a program from source with the build @options. when a @cache
+	 * is given, the binary is taken from the cache if possible and the
+	 * cache is updated otherwise
+	 */
+	cl_int
+	build_from_source (const Context &context, const char *src,
+			const ProgramCache *cache = NULL,
+			const char *options = NULL)
+	{
+		cl_int err;
+
+		settle();
+		log.clear();
+		TraceScope trace("build", "build");
+		trace.detail(options);
+		if (cache)
+			return cache->build(context(), src, options,
+					&this->cl_obj, &log);
+
+		size_t len[] = {strlen(src)};
+		this->cl_obj = clCreateProgramWithSource(context(), 1, &src,
+				len, &err);
+		if (err != CL_SUCCESS)
+			return err;
+
+		err = clBuildProgram(this->cl_obj, 0, NULL, options, NULL, NULL);
+		if (err != CL_SUCCESS)
+			program_build_log(this->cl_obj, &log);
+		return err;
+	}
+
+
+	/**
+	 * build a specialization of a program, the prelude of @opts is put in
+	 * front of @src
+	 */
+	cl_int
+	build_from_source (const Context &context, const char *src,
+			const BuildOptions &opts,
+			const ProgramCache *cache = NULL)
+	{
+		if (opts.prelude.empty())
+			return build_from_source(context, src, cache,
+					opts.options.c_str());
+
+		std::string full = opts.prelude + src;
+		return build_from_source(context, full.c_str(), cache,
+				opts.options.c_str());
+	}
+
+
+	/**
+	 * build a program in the background of the OpenCL runtime. the future
+	 * becomes ready when the build notification arrives. note that some
+	 * runtimes build synchronously even when a callback is given, use the
+	 * ThreadPool overload to build several programs concurrently on those
+	 */
+	std::future<cl_int>
+	build_async (const Context &context, const char *src,
+			const BuildOptions &opts = BuildOptions())
+	{
+		cl_int err;
+
+		settle();
+		pending.reset(new AsyncBuild(&log, opts.options.c_str()));
+		std::future<cl_int> result = pending->promise.get_future();
+		log.clear();
+
+		std::string full = opts.prelude + src;
+		const char *s = full.c_str();
+		size_t len[] = {full.size()};
+		container_type::reset(clCreateProgramWithSource(context(), 1,
+				&s, len, &err));
+		if (err != CL_SUCCESS) {
+			pending->finish(NULL, err);
+			return result;
+		}
+
+		err = clBuildProgram(this->cl_obj, 0, NULL, opts.options.c_str(),
+				build_notify, pending.get());
+		if (err != CL_SUCCESS)
+			pending->finish(this->cl_obj, err);
+		return result;
+	}
+
+
+	/**
+	 * build a program on a worker of @pool. @context and @cache have to
+	 * stay valid until the build has finished
+	 */
+	std::future<cl_int>
+	build_async (ThreadPool &pool, const Context &context, const char *src,
+			const BuildOptions &opts = BuildOptions(),
+			const ProgramCache *cache = NULL)
+	{
+		cl_context ctx = context();
+		std::string s(src);
+		return pool.async([this, ctx, s, opts, cache]() {
+			Context c;
+			c.reset(ctx, false);
+			return this->build_from_source(c, s.c_str(), opts,
+					cache);
+		});
+	}
+
+
+	/**
+	 * read and build a program on a worker of @pool
+	 */
+	std::future<cl_int>
+	build_file_async (ThreadPool &pool, const Context &context,
+			const char *fname,
+			const BuildOptions &opts = BuildOptions(),
+			const ProgramCache *cache = NULL)
+	{
+		cl_context ctx = context();
+		std::string f(fname);
+		return pool.async([this, ctx, f, opts, cache]() {
+			Context c;
+			c.reset(ctx, false);
+			return this->build_from_file(c, f.c_str(), opts, cache);
+		});
+	}
+
+
+	cl_int
+	build_from_file (const Context &context, const char *fname,
+			const ProgramCache *cache = NULL,
+			const char *options = NULL)
+	{
+		cl_int err;
+		std::ifstream f(fname);
+		if (!f.is_open())
+			return CL_INVALID_PROGRAM;
+
+		std::string str((std::istreambuf_iterator<char>(f)),
+				std::istreambuf_iterator<char>());
+		err = build_from_source(context, str.c_str(), cache, options);
+		f.close();
+
+		return err;
+	}
+
+
+	cl_int
+	build_from_file (const Context &context, const char *fname,
+			const BuildOptions &opts,
+			const ProgramCache *cache = NULL)
+	{
+		cl_int err;
+		std::ifstream f(fname);
+		if (!f.is_open())
+			return CL_INVALID_PROGRAM;
+
+		std::string str((std::istreambuf_iterator<char>(f)),
+				std::istreambuf_iterator<char>());
+		err = build_from_source(context, str.c_str(), opts, cache);
+		f.close();
+
+		return err;
+	}
+
+
+private:
+	//! wait for a pending asynchronous build, the callback refers to it
+	void
+	settle ()
+	{
+		if (pending)
+			pending->wait();
+		pending.reset();
+	}
+
+
+	static void CL_CALLBACK
+	build_notify (cl_program prog, void *data)
+	{
+		((AsyncBuild*)data)->finish(prog, program_build_status(prog));
+	}
+};
+
+
+/**
+ * struct ProgramVariants - specialized variants of one program source.
+ *
+ * Every distinct set of BuildOptions is built once and kept until the
+ * variants are cleared, so switching between specializations at run time
+ * (e.g. per element type or vector width) only costs a map lookup. Programs
+ * handed out by get() are owned by the variants and must not outlive them.
+ * get() is thread-safe.
+ *
+ * @src:	program source without prelude
+ * @cache:	optional on-disk cache for the built binaries
+ */
+struct ProgramVariants
+{
+	cl_context ctx;
+	std::string src;
+	const ProgramCache *cache;
+
+	std::mutex lock;
+	std::map<std::string, cl_program> programs;
+
+
+	ProgramVariants ()
+		: ctx(NULL)
+		, cache(NULL)
+	{}
+
+
+	ProgramVariants (const ProgramVariants &) = delete;
+	ProgramVariants& operator= (const ProgramVariants &) = delete;
+
+
+	~ProgramVariants ()
+	{
+		clear();
+	}
+
+
+	cl_int
+	create (const Context &context, const char *source,
+			const ProgramCache *cache = NULL)
+	{
+		clear();
+		this->ctx = context();
+		this->src = source;
+		this->cache = cache;
+		return CL_SUCCESS;
+	}
+
+
+	cl_int
+	create_from_file (const Context &context, const char *fname,
+			const ProgramCache *cache = NULL)
+	{
+		std::ifstream f(fname);
+		if (!f.is_open())
+			return CL_INVALID_PROGRAM;
+
+		std::string str((std::istreambuf_iterator<char>(f)),
+				std::istreambuf_iterator<char>());
+		return create(context, str.c_str(), cache);
+	}
+
+
+	/**
+	 * get the variant specialized by @opts, building it on first use
+	 */
+	cl_int
+	get (const BuildOptions &opts, cl_program *prog)
+	{
+		if (!ctx)
+			return CL_INVALID_CONTEXT;
+
+		std::string k = opts.key();
+		std::lock_guard<std::mutex> guard(lock);
+		std::map<std::string, cl_program>::iterator it = programs.find(k);
+		if (it != programs.end()) {
+			*prog = it->second;
+			return CL_SUCCESS;
+		}
+
+		Context context;
+		Program p;
+		context.reset(ctx, false);
+		cl_int err = p.build_from_source(context, src.c_str(), opts,
+				cache);
+		if (err != CL_SUCCESS)
+			return err;
+
+		// the variants own the program from now on
+		p.release_on_destroy = false;
+		programs[k] = p();
+		*prog = p();
+		return CL_SUCCESS;
+	}
+
+
+	/**
+	 * get a variant as non-owning Program, e.g. to create kernels from it
+	 */
+	cl_int
+	get (const BuildOptions &opts, Program &prog)
+	{
+		cl_program p;
+		cl_int err = get(opts, &p);
+		if (err == CL_SUCCESS)
+			prog.reset(p, false);
+		return err;
+	}
+
+
+	size_t
+	size ()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		return programs.size();
+	}
+
+
+	/**
+	 * release all variants
+	 */
+	void
+	clear ()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		std::map<std::string, cl_program>::iterator it;
+		for (it = programs.begin(); it != programs.end(); ++it)
+			clReleaseProgram(it->second);
+		programs.clear();
+	}
+};
+
+
+/**
+ * struct Kernel - wrapping the cl_kernel object into some templated functions
+ * to reduce direct OpenCL function invocation/typing.
+ *
+ * @k:			the contained cl_kernel object
+ * @release_on_destroy:	determines if the contained cl_kernel object is released
+ *			by clReleaseKernel when the cl::Kernel object is
+ *			destroyed
+ */
+struct Kernel : CLObjContainer<cl_kernel, clReleaseKernel>
+		, CommandQueueJunction
+{
+	/**
+	 * create a new kernel instance by passing the cl_kernel object to it.
+	 *
+	 * @kernel:		An existing cl_kernel object
+	 * @release_on_destroy:	Decide whether the contained cl_kernel object
+	 *			shall be released when cl::Kernel object is
+	 *			destroyed
+	 */
+	Kernel (cl_kernel kernel = NULL, bool release_on_destroy = true)
+		: CLObjContainer(kernel, release_on_destroy)
+	{}
+
+
+	/**
+	 * set one or many kernel arguments. consecutive calls to this function
+	 * might overwrite previously set arguments as the argument index is
+	 * deduced from argument count
+	 */
+	template <typename... Args>
+	cl_int
+	set_args (const Args&... args)
+	{
+		return set_kernel_args(this->cl_obj, args...);
+	}
+
+
+	/**
+	 * set a specific kernel argument
+	 *
+	 * @n:		Argument index (starting by 0)
+	 * @arg:	Argument value
+	 */
+	template <typename T>
+	cl_int
+	set_arg (unsigned int n, const T &arg)
+	{
+		return clSetKernelArg(this->cl_obj, n, CLTypeTraits<T>::size(arg),
+				KernelArg<T>::ptr(arg));
+	}
+
+
+	/**
+	 * create a kernel by name from a given program object
+	 */
+	cl_int
+	create (const Program &program, const char *kernel_name)
+	{
+		cl_int err;
+		this->cl_obj = clCreateKernel(program(), kernel_name, &err);
+		return err;
+	}
+
+
+	/**
+	 * run the kernel on the associated context/commandq.
+	 */
+	cl_int
+	run (cl_uint work_dim, const size_t *global_work_size,
+			const size_t *local_work_size,
+			const size_t *global_work_offset = 0,
+			cl_uint num_events_in_wait_list = 0,
+			const cl_event 	*event_wait_list = NULL,
+			cl_event *event = NULL)
+	{
+
+		if (!(this->command_queue))
+			return CL_INVALID_COMMAND_QUEUE;
+
+		TraceScope trace("kernel", "kernel",
+				this->command_queue->cl_obj, event);
+		trace.kernel(this->cl_obj);
+		return clEnqueueNDRangeKernel(this->command_queue->cl_obj,
+				this->cl_obj, work_dim, global_work_offset,
+				global_work_size, local_work_size,
+				num_events_in_wait_list, event_wait_list,
+				trace.event());
+	}
+
+
+	/**
+	 * run the kernel on a command queue after all events in @wait have
+	 * finished. the event of the kernel execution is stored in @event
+	 */
+	cl_int
+	run (const cl_command_queue q, cl_uint work_dim,
+			const size_t *global_work_size,
+			const size_t *local_work_size, const EventList &wait,
+			Event *event = NULL,
+			const size_t *global_work_offset = NULL)
+	{
+		EventSlot slot(event);
+		TraceScope trace("kernel", "kernel", q, slot);
+		trace.kernel(this->cl_obj);
+		return clEnqueueNDRangeKernel(q, this->cl_obj, work_dim,
+				global_work_offset, global_work_size,
+				local_work_size, wait.size(), wait.data(),
+				trace.event());
+	}
+
+
+	cl_int
+	run (const CommandQueue &q, cl_uint work_dim,
+			const size_t *global_work_size,
+			const size_t *local_work_size, const EventList &wait,
+			Event *event = NULL,
+			const size_t *global_work_offset = NULL)
+	{
+		return run(q(), work_dim, global_work_size, local_work_size,
+				wait, event, global_work_offset);
+	}
+
+
+	/**
+	 * run the kernel on the associated commandq after all events in @wait
+	 * have finished
+	 */
+	cl_int
+	run (cl_uint work_dim, const size_t *global_work_size,
+			const size_t *local_work_size, const EventList &wait,
+			Event *event = NULL,
+			const size_t *global_work_offset = NULL)
+	{
+		if (!(this->command_queue))
+			return CL_INVALID_COMMAND_QUEUE;
+
+		return run(*(this->command_queue), work_dim, global_work_size,
+				local_work_size, wait, event,
+				global_work_offset);
+	}
+};
+
+
+/**
+ * struct KernelArgInfo - declaration of a kernel argument. only available for
+ * OpenCL 1.2 programs built with -cl-kernel-arg-info (some runtimes provide
+ * it without the option)
+ *
+ * @address:	CL_KERNEL_ARG_ADDRESS_GLOBAL, _LOCAL, _CONSTANT or _PRIVATE
+ * @access:	image access qualifier, CL_KERNEL_ARG_ACCESS_NONE for all
+ *		other arguments
+ * @qualifier:	bit field of CL_KERNEL_ARG_TYPE_CONST, _RESTRICT and
+ *		_VOLATILE
+ */
+struct KernelArgInfo
+{
+	std::string name;
+	std::string type_name;
+	cl_uint address;
+	cl_uint access;
+	cl_bitfield qualifier;
+
+
+	KernelArgInfo ()
+		: address(0)
+		, access(0)
+		, qualifier(0)
+	{}
+};
+
+
+/**
+ * struct KernelInfo - the properties of a kernel on a device that are
+ * relevant for launching it.
+ *
+ * @arg_info:		true if @args holds the argument declarations
+ * @work_group_size:	largest work-group the kernel can be launched with
+ * @compile_work_group_size: size given by reqd_work_group_size, or zeros
+ * @preferred_multiple:	preferred multiple of the work-group size
+ * @local_mem_size:	local memory used by the kernel, including local
+ *			memory arguments set so far
+ * @private_mem_size:	private memory used by each work-item
+ */
+struct KernelInfo
+{
+	std::string name;
+	cl_uint num_args;
+	bool arg_info;
+	std::vector<KernelArgInfo> args;
+
+	size_t work_group_size;
+	size_t compile_work_group_size[3];
+	size_t preferred_multiple;
+	cl_ulong local_mem_size;
+	cl_ulong private_mem_size;
+
+
+	KernelInfo ()
+		: num_args(0), arg_info(false), work_group_size(0)
+		, preferred_multiple(0), local_mem_size(0), private_mem_size(0)
+	{
+		memset(compile_work_group_size, 0,
+				sizeof(compile_work_group_size));
+	}
+
+
+	/**
+	 * read all properties of @kernel on @device
+	 */
+	cl_int
+	query (cl_kernel kernel, cl_device_id device)
+	{
+		cl_int err;
+		size_t len = 0;
+
+		err = clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, 0, NULL,
+				&len);
+		if (err != CL_SUCCESS)
+			return err;
+		std::vector<char> buf(len + 1, 0);
+		err = clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, len,
+				&buf[0], NULL);
+		if (err == CL_SUCCESS)
+			err = clGetKernelInfo(kernel, CL_KERNEL_NUM_ARGS,
+					sizeof(num_args), &num_args, NULL);
+		if (err != CL_SUCCESS)
+			return CL_INVALID_KERNEL;
+		name = &buf[0];
+
+		err = clGetKernelWorkGroupInfo(kernel, device,
+				CL_KERNEL_WORK_GROUP_SIZE,
+				sizeof(work_group_size), &work_group_size, NULL);
+		if (err == CL_SUCCESS)
+			err = clGetKernelWorkGroupInfo(kernel, device,
+					CL_KERNEL_COMPILE_WORK_GROUP_SIZE,
+					sizeof(compile_work_group_size),
+					compile_work_group_size, NULL);
+		if (err == CL_SUCCESS)
+			err = clGetKernelWorkGroupInfo(kernel, device,
+					CL_KERNEL_LOCAL_MEM_SIZE,
+					sizeof(local_mem_size), &local_mem_size,
+					NULL);
+		if (err != CL_SUCCESS)
+			return err;
+
+		// OpenCL 1.1 properties, leave the defaults on older devices
+		clGetKernelWorkGroupInfo(kernel, device,
+				CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+				sizeof(preferred_multiple), &preferred_multiple,
+				NULL);
+		clGetKernelWorkGroupInfo(kernel, device,
+				CL_KERNEL_PRIVATE_MEM_SIZE,
+				sizeof(private_mem_size), &private_mem_size, NULL);
+
+		args.clear();
+		arg_info = false;
+#ifdef CL_VERSION_1_2
+		args.resize(num_args);
+		arg_info = true;
+		for (cl_uint i = 0; i < num_args && arg_info; i++) {
+			KernelArgInfo &a = args[i];
+			err = clGetKernelArgInfo(kernel, i,
+					CL_KERNEL_ARG_ADDRESS_QUALIFIER,
+					sizeof(a.address), &a.address, NULL);
+			if (err == CL_SUCCESS)
+				err = clGetKernelArgInfo(kernel, i,
+						CL_KERNEL_ARG_ACCESS_QUALIFIER,
+						sizeof(a.access), &a.access,
+						NULL);
+			if (err == CL_SUCCESS)
+				err = clGetKernelArgInfo(kernel, i,
+						CL_KERNEL_ARG_TYPE_QUALIFIER,
+						sizeof(a.qualifier),
+						&a.qualifier, NULL);
+			a.type_name = arg_info_string(kernel, i,
+					CL_KERNEL_ARG_TYPE_NAME);
+			a.name = arg_info_string(kernel, i, CL_KERNEL_ARG_NAME);
+			arg_info = err == CL_SUCCESS;
+		}
+		if (!arg_info)
+			args.clear();
+#endif
+		return CL_SUCCESS;
+	}
+
+
+	/**
+	 * index of the argument called @name, num_args if there is no such
+	 * argument or no argument information
+	 */
+	cl_uint
+	arg_index (const char *name) const
+	{
+		for (cl_uint i = 0; i < args.size(); i++)
+			if (args[i].name == name)
+				return i;
+		return num_args;
+	}
+
+
+private:
+#ifdef CL_VERSION_1_2
+	static std::string
+	arg_info_string (cl_kernel kernel, cl_uint i, cl_kernel_arg_info param)
+	{
+		size_t len = 0;
+		if (clGetKernelArgInfo(kernel, i, param, 0, NULL, &len)
+		    != CL_SUCCESS || !len)
+			return std::string();
+
+		std::vector<char> buf(len);
+		if (clGetKernelArgInfo(kernel, i, param, len, &buf[0], NULL)
+		    != CL_SUCCESS)
+			return std::string();
+		return std::string(&buf[0]);
+	}
+#endif
+};
+
+
+/**
+ * struct KernelRegistry - all kernels of a program, created at once and
+ * indexed by name.
+ *
+ * Look up a kernel by name once with find() and use the index in hot code,
+ * operator[] is a plain array access. The registry owns the kernels.
+ *
+ *	KernelRegistry kernels;
+ *	kernels.create(program, device);
+ *	const size_t scale = kernels.find("scale");
+ *	...
+ *	kernels[scale].set_args(buf, 2.0f);
+ */
+struct KernelRegistry
+{
+	std::vector<Kernel> kernels;
+	std::vector<KernelInfo> infos;
+	std::map<std::string, size_t> index;
+
+
+	KernelRegistry ()
+	{}
+
+
+	KernelRegistry (const KernelRegistry &) = delete;
+	KernelRegistry& operator= (const KernelRegistry &) = delete;
+
+
+	/**
+	 * create every kernel of @program and query its properties on @device
+	 */
+	cl_int
+	create (const Program &program, const Device &device)
+	{
+		cl_int err;
+		cl_uint n = 0;
+
+		clear();
+		err = clCreateKernelsInProgram(program(), 0, NULL, &n);
+		if (err != CL_SUCCESS)
+			return err;
+		if (!n)
+			return CL_SUCCESS;
+
+		std::vector<cl_kernel> k(n);
+		err = clCreateKernelsInProgram(program(), n, &k[0], NULL);
+		if (err != CL_SUCCESS)
+			return err;
+
+		kernels.resize(n);
+		infos.resize(n);
+		for (cl_uint i = 0; i < n; i++)
+			kernels[i].reset(k[i]);
+		for (cl_uint i = 0; i < n; i++) {
+			err = infos[i].query(k[i], device());
+			if (err != CL_SUCCESS) {
+				clear();
+				return err;
+			}
+			index[infos[i].name] = i;
+		}
+		return CL_SUCCESS;
+	}
+
+
+	size_t
+	size () const
+	{
+		return kernels.size();
+	}
+
+
+	/**
+	 * index of the kernel called @name, size() if there is no such kernel
+	 */
+	size_t
+	find (const std::string &name) const
+	{
+		std::map<std::string, size_t>::const_iterator it =
+			index.find(name);
+		return it == index.end() ? kernels.size() : it->second;
+	}
+
+
+	/**
+	 * get a kernel by name, NULL if there is no such kernel
+	 */
+	Kernel*
+	get (const std::string &name)
+	{
+		size_t i = find(name);
+		return i < kernels.size() ? &kernels[i] : NULL;
+	}
+
+
+	Kernel&
+	operator[] (size_t i)
+	{
+		return kernels[i];
+	}
+
+
+	const KernelInfo&
+	info (size_t i) const
+	{
+		return infos[i];
+	}
+
+
+	void
+	clear ()
+	{
+		index.clear();
+		infos.clear();
+		kernels.clear();
+	}
+};
+
+
+/**
+ * struct NDRange - work size in up to three dimensions. a default constructed
+ * NDRange has no dimensions and is passed as NULL to OpenCL
+ */
+struct NDRange
+{
+	cl_uint dims;
+	size_t size[3];
+
+
+	NDRange () : dims(0) { size[0] = size[1] = size[2] = 0; }
+
+	NDRange (size_t x) : dims(1) { size[0] = x; size[1] = size[2] = 1; }
+
+	NDRange (size_t x, size_t y) : dims(2)
+	{
+		size[0] = x; size[1] = y; size[2] = 1;
+	}
+
+	NDRange (size_t x, size_t y, size_t z) : dims(3)
+	{
+		size[0] = x; size[1] = y; size[2] = z;
+	}
+
+
+	const size_t*
+	ptr () const
+	{
+		return dims ? size : NULL;
+	}
+
+
+	size_t
+	total () const
+	{
+		return size[0] * size[1] * size[2];
+	}
+};
+
+
+/**
+ * struct KernelRange - global work size, local work size and global offset
+ * of a kernel launch
+ */
+struct KernelRange
+{
+	NDRange global;
+	NDRange local;
+	NDRange offset;
+
+
+	KernelRange (const NDRange &global, const NDRange &local = NDRange(),
+			const NDRange &offset = NDRange())
+		: global(global)
+		, local(local)
+		, offset(offset)
+	{}
+
+
+	/**
+	 * 1-D range, a @local of 0 lets the implementation decide
+	 */
+	explicit
+	KernelRange (size_t global, size_t local = 0)
+		: global(global)
+		, local(local ? NDRange(local) : NDRange())
+	{}
+};
+
+
+/**
+ * the KernelArgCache class determines what is remembered of a kernel argument
+ * to detect if it changed between two launches. this is the value for plain
+ * types and the handle for OpenCL objects.
+ */
+template <typename T>
+struct KernelArgCache
+{
+	typedef T type;
+
+	static type value (const T &arg) { return arg; }
+};
+
+
+template <>
+struct KernelArgCache <LocalMemory>
+{
+	typedef size_t type;
+
+	static type value (const LocalMemory &arg) { return arg.size; }
+};
+
+
+template <typename CLType, cl_int (*RFunc)(CLType)>
+struct KernelArgCache <CLObjContainer<CLType, RFunc>>
+{
+	typedef CLType type;
+
+	static type
+	value (const CLObjContainer<CLType, RFunc> &arg)
+	{
+		return arg.cl_obj;
+	}
+};
+
+
+template <typename T>
+struct KernelArgCache <Buffer<T>>
+{
+	typedef cl_mem type;
+
+	static type value (const Buffer<T> &arg) { return arg.cl_obj; }
+};
+
+
+template <unsigned Dim>
+struct KernelArgCache <Image<Dim>>
+{
+	typedef cl_mem type;
+
+	static type value (const Image<Dim> &arg) { return arg.cl_obj; }
+};
+
+
+template <>
+struct KernelArgCache <Sampler>
+{
+	typedef cl_sampler type;
+
+	static type value (const Sampler &arg);
+};
+
+
+/**
+ * struct KernelFunctor - kernel with a fixed argument signature.
+ *
+ * Setting the arguments and enqueueing the kernel is done in one call:
+ *
+ *	KernelFunctor<Buffer<float>, Buffer<float>, cl_uint> f;
+ *	f.create(program, "scale");
+ *	f.bind_to(queue);
+ *	f(KernelRange(n, 64), dst, src, n);
+ *
+ * The functor remembers the last value of every argument and only calls
+ * clSetKernelArg for arguments that changed. When the arguments of the
+ * underlying cl_kernel are modified by other means (e.g. Kernel::set_args),
+ * call invalidate() before the next launch.
+ */
+template <typename... Args>
+struct KernelFunctor : Kernel
+{
+	static const cl_uint num_args = sizeof...(Args);
+
+	//! last value of each argument as raw bytes, empty if unknown
+	std::vector<std::vector<unsigned char>> last;
+
+
+	KernelFunctor (cl_kernel kernel = NULL, bool release_on_destroy = true)
+		: Kernel(kernel, release_on_destroy)
+		, last(num_args)
+	{}
+
+
+	/**
+	 * create the kernel and check that its number of arguments matches the
+	 * signature
+	 */
+	cl_int
+	create (const Program &program, const char *kernel_name)
+	{
+		cl_int err = Kernel::create(program, kernel_name);
+		if (err != CL_SUCCESS)
+			return err;
+
+		cl_uint n = 0;
+		err = clGetKernelInfo(this->cl_obj, CL_KERNEL_NUM_ARGS,
+				sizeof(n), &n, NULL);
+		if (err != CL_SUCCESS)
+			return err;
+		invalidate();
+		return n == num_args ? CL_SUCCESS : CL_INVALID_KERNEL_ARGS;
+	}
+
+
+	/**
+	 * forget the remembered arguments, all of them are set on the next
+	 * launch
+	 */
+	void
+	invalidate ()
+	{
+		for (size_t i = 0; i < last.size(); i++)
+			last[i].clear();
+	}
+
+
+	/**
+	 * set all arguments that differ from the previous call
+	 */
+	cl_int
+	bind (const Args&... args)
+	{
+		return bind_args<Args...>(0, args...);
+	}
+
+
+	/**
+	 * set the arguments and enqueue the kernel on @q after all events in
+	 * @wait have finished
+	 */
+	cl_int
+	operator() (const cl_command_queue q, const KernelRange &range,
+			const EventList &wait, Event *event,
+			const Args&... args)
+	{
+		cl_int err = bind(args...);
+		if (err != CL_SUCCESS)
+			return err;
+
+		EventSlot slot(event);
+		TraceScope trace("kernel", "kernel", q, slot);
+		trace.kernel(this->cl_obj);
+		return clEnqueueNDRangeKernel(q, this->cl_obj,
+				range.global.dims, range.offset.ptr(),
+				range.global.ptr(), range.local.ptr(),
+				wait.size(), wait.data(), trace.event());
+	}
+
+
+	cl_int
+	operator() (const CommandQueue &q, const KernelRange &range,
+			const EventList &wait, Event *event,
+			const Args&... args)
+	{
+		return (*this)(q(), range, wait, event, args...);
+	}
+
+
+	/**
+	 * set the arguments and enqueue the kernel on the bound commandq
+	 */
+	cl_int
+	operator() (const KernelRange &range, const Args&... args)
+	{
+		if (!(this->command_queue))
+			return CL_INVALID_COMMAND_QUEUE;
+
+		return (*this)(this->command_queue->cl_obj, range, EventList(),
+				NULL, args...);
+	}
+
+
+private:
+	template <typename... Rest>
+	cl_int
+	bind_args (cl_uint, const Rest&...)
+	{
+		return CL_SUCCESS;
+	}
+
+
+	template <typename A, typename... Rest>
+	cl_int
+	bind_args (cl_uint i, const A &arg, const Rest&... rest)
+	{
+		typename KernelArgCache<A>::type v = KernelArgCache<A>::value(arg);
+		const unsigned char *bytes = (const unsigned char*)&v;
+		std::vector<unsigned char> &l = last[i];
+
+		if (l.size() != sizeof(v) || memcmp(&l[0], bytes, sizeof(v))) {
+			cl_int err = clSetKernelArg(this->cl_obj, i,
+					CLTypeTraits<A>::size(arg),
+					KernelArg<A>::ptr(arg));
+			if (err != CL_SUCCESS) {
+				l.clear();
+				return err;
+			}
+			l.assign(bytes, bytes + sizeof(v));
+		}
+		return bind_args<Rest...>(i + 1, rest...);
+	}
+};
+
+
+/**
+ * struct QueueScheduler - distributes independent commands over several
+ * command queues of one device, so that devices with concurrent copy and
+ * compute engines can overlap them.
+ *
+ * ROUND_ROBIN cycles through the queues, LEAST_LOADED picks the queue with the
+ * fewest unfinished commands that were submitted through the scheduler.
+ * Commands submitted through the scheduler must not depend on the order of
+ * execution unless the dependencies are expressed in their wait lists.
+ */
+struct QueueScheduler
+{
+	enum Policy {
+		ROUND_ROBIN,
+		LEAST_LOADED
+	};
+
+	typedef std::function<cl_int (cl_command_queue, cl_event*)> command_type;
+
+
+	Policy policy;
+	std::vector<cl_command_queue> queues;
+
+	//! unfinished commands per queue (retained by the scheduler)
+	std::vector<std::vector<cl_event>> pending;
+
+	size_t rr_next;
+
+
+	QueueScheduler (Policy policy = ROUND_ROBIN)
+		: policy(policy)
+		, rr_next(0)
+	{}
+
+
+	QueueScheduler (const QueueScheduler &) = delete;
+	QueueScheduler& operator= (const QueueScheduler &) = delete;
+
+
+	~QueueScheduler ()
+	{
+		release();
+	}
+
+
+	/**
+	 * create @n command queues on @device
+	 */
+	cl_int
+	create (const Context &context, const Device &device, size_t n,
+			cl_command_queue_properties properties = 0)
+	{
+		release();
+		for (size_t i = 0; i < n; i++) {
+			cl_int err;
+			cl_command_queue q = clCreateCommandQueue(context(),
+					device(), properties, &err);
+			if (err != CL_SUCCESS) {
+				release();
+				return err;
+			}
+			queues.push_back(q);
+		}
+		pending.resize(n);
+		return n ? CL_SUCCESS : CL_INVALID_VALUE;
+	}
+
+
+	void
+	release ()
+	{
+		for (size_t i = 0; i < pending.size(); i++)
+			for (size_t j = 0; j < pending[i].size(); j++)
+				clReleaseEvent(pending[i][j]);
+		for (size_t i = 0; i < queues.size(); i++)
+			clReleaseCommandQueue(queues[i]);
+		pending.clear();
+		queues.clear();
+		rr_next = 0;
+	}
+
+
+	size_t
+	size () const
+	{
+		return queues.size();
+	}
+
+
+	cl_command_queue
+	queue (size_t i) const
+	{
+		return queues[i];
+	}
+
+
+	/**
+	 * number of unfinished commands on queue @i. finished commands are
+	 * dropped from the bookkeeping
+	 */
+	size_t
+	load (size_t i)
+	{
+		std::vector<cl_event> &p = pending[i];
+		size_t n = 0;
+		for (size_t j = 0; j < p.size(); j++) {
+			cl_int status;
+			cl_int err = clGetEventInfo(p[j],
+					CL_EVENT_COMMAND_EXECUTION_STATUS,
+					sizeof(status), &status, NULL);
+			if (err == CL_SUCCESS && status > CL_COMPLETE)
+				p[n++] = p[j];
+			else
+				clReleaseEvent(p[j]);
+		}
+		p.resize(n);
+		return n;
+	}
+
+
+	/**
+	 * index of the queue the next command shall be submitted to
+	 */
+	size_t
+	next ()
+	{
+		if (policy == LEAST_LOADED) {
+			size_t best = 0, best_load = load(0);
+			for (size_t i = 1; i < queues.size() && best_load; i++) {
+				size_t l = load(i);
+				if (l < best_load) {
+					best = i;
+					best_load = l;
+				}
+			}
+			return best;
+		}
+
+		size_t i = rr_next;
+		rr_next = (rr_next + 1) % queues.size();
+		return i;
+	}
+
+
+	/**
+	 * submit an arbitrary command. @cmd receives the selected queue and the
+	 * location where it has to store the event of the command
+	 */
+	cl_int
+	submit (const command_type &cmd, Event *event = NULL)
+	{
+		if (queues.empty())
+			return CL_INVALID_COMMAND_QUEUE;
+
+		size_t i = next();
+		cl_event e = NULL;
+		cl_int err = cmd(queues[i], &e);
+		if (err != CL_SUCCESS || !e)
+			return err;
+
+		// next() only drops finished commands for LEAST_LOADED, keep
+		// the bookkeeping bounded for the other policies as well
+		if (policy != LEAST_LOADED)
+			load(i);
+		clRetainEvent(e);
+		pending[i].push_back(e);
+		if (event)
+			event->reset(e);
+		else
+			clReleaseEvent(e);
+		return CL_SUCCESS;
+	}
+
+
+	/**
+	 * run a kernel on the next queue. the kernel arguments are captured at
+	 * the time of the call
+	 */
+	cl_int
+	run (Kernel &kernel, cl_uint work_dim, const size_t *global_work_size,
+			const size_t *local_work_size,
+			const EventList &wait = EventList(), Event *event = NULL,
+			const size_t *global_work_offset = NULL)
+	{
+		return submit([&](cl_command_queue q, cl_event *e) {
+				TraceScope trace("kernel", "kernel", q, e);
+				trace.kernel(kernel());
+				return clEnqueueNDRangeKernel(q, kernel(),
+						work_dim, global_work_offset,
+						global_work_size,
+						local_work_size, wait.size(),
+						wait.data(), trace.event());
+			}, event);
+	}
+
+
+	/**
+	 * flush all queues
+	 */
+	cl_int
+	flush ()
+	{
+		cl_int err = CL_SUCCESS;
+		for (size_t i = 0; i < queues.size(); i++) {
+			cl_int e = clFlush(queues[i]);
+			if (err == CL_SUCCESS)
+				err = e;
+		}
+		return err;
+	}
+
+
+	/**
+	 * wait for all commands on all queues
+	 */
+	cl_int
+	finish ()
+	{
+		cl_int err = CL_SUCCESS;
+		for (size_t i = 0; i < queues.size(); i++) {
+			cl_int e = clFinish(queues[i]);
+			if (err == CL_SUCCESS)
+				err = e;
+			load(i);
+		}
+		return err;
+	}
+};
+
+
+/**
+ * struct Dispatcher - launches the kernels of a program from many host
+ * threads.
+ *
+ * The argument state of a cl_kernel is shared by all threads using it, so
+ * every worker of the dispatcher has its own command queue and its own
+ * instances of all kernels of the program, bound to that queue. Tasks are
+ * run by a WorkStealingPool and get the state of the worker that runs them,
+ * they may set arguments, launch kernels and transfer buffers without any
+ * further locking.
+ *
+ *	size_t scale = dispatcher.find("scale");
+ *	std::future<cl_int> f = dispatcher.submit([&](Dispatcher::Worker &w) {
+ *		w.kernels[scale].set_args(buf, 2.0f);
+ *		return w.kernels[scale].run(1, &n, NULL);
+ *	});
+ */
+struct Dispatcher
+{
+	struct Worker
+	{
+		CommandQueue queue;
+		KernelRegistry kernels;
+	};
+
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	WorkStealingPool pool;
+
+
+	Dispatcher ()
+	{}
+
+
+	Dispatcher (const Dispatcher &) = delete;
+	Dispatcher& operator= (const Dispatcher &) = delete;
+
+
+	~Dispatcher ()
+	{
+		release();
+	}
+
+
+	/**
+	 * create @nthreads workers (one per hardware thread if 0) with a
+	 * command queue created with @properties and all kernels of @program
+	 */
+	cl_int
+	create (const Context &context, const Device &device,
+			const Program &program, unsigned nthreads = 0,
+			cl_command_queue_properties properties = 0)
+	{
+		cl_int err;
+
+		release();
+		if (!nthreads)
+			nthreads = std::thread::hardware_concurrency();
+		if (!nthreads)
+			nthreads = 1;
+
+		for (unsigned i = 0; i < nthreads; i++) {
+			std::unique_ptr<Worker> w(new Worker);
+			err = w->queue.create(device, context, properties);
+			if (err == CL_SUCCESS)
+				err = w->kernels.create(program, device);
+			if (err != CL_SUCCESS) {
+				release();
+				return err;
+			}
+			for (size_t k = 0; k < w->kernels.size(); k++)
+				w->kernels[k].bind_to(w->queue);
+			workers.push_back(std::move(w));
+		}
+		return pool.create(nthreads);
+	}
+
+
+	/**
+	 * index of the kernel called @name in the registries of all workers.
+	 * like KernelRegistry::find, the index is not below the size of the
+	 * registries if there is no such kernel or no worker
+	 */
+	size_t
+	find (const std::string &name) const
+	{
+		if (workers.empty())
+			return std::numeric_limits<size_t>::max();
+		return workers[0]->kernels.find(name);
+	}
+
+
+	/**
+	 * run @task on a worker, the future holds its result. without workers
+	 * (before create() or after release()) the future holds
+	 * CL_INVALID_COMMAND_QUEUE
+	 */
+	std::future<cl_int>
+	submit (std::function<cl_int (Worker &)> task)
+	{
+		if (workers.empty()) {
+			std::promise<cl_int> p;
+			p.set_value(CL_INVALID_COMMAND_QUEUE);
+			return p.get_future();
+		}
+
+		return pool.async([this, task](unsigned i) {
+			return task(*workers[i]);
+		});
+	}
+
+
+	/**
+	 * flush the queues of all workers
+	 */
+	cl_int
+	flush ()
+	{
+		cl_int err = CL_SUCCESS;
+		for (size_t i = 0; i < workers.size(); i++)
+			if (err == CL_SUCCESS)
+				err = workers[i]->queue.flush();
+		return err;
+	}
+
+
+	/**
+	 * wait for the commands in all worker queues. tasks that are still
+	 * queued in the pool are not waited for, wait for their futures first
+	 */
+	cl_int
+	finish ()
+	{
+		cl_int err = CL_SUCCESS;
+		for (size_t i = 0; i < workers.size(); i++)
+			if (err == CL_SUCCESS)
+				err = workers[i]->queue.finish();
+		return err;
+	}
+
+
+	/**
+	 * run the remaining tasks, stop the pool and release all workers
+	 */
+	void
+	release ()
+	{
+		pool.stop();
+		workers.clear();
+	}
+};
+
+
+/**
+ * struct DevicePartition - runs one NDRange split over several devices that
+ * share a context.
+ *
+ * The global range is cut along its outermost dimension (x for 1-D, y for
+ * 2-D) into one slice per device. Each slice is enqueued on the queue of its
+ * device with the matching global offset. Slices are multiples of the local
+ * work size in that dimension, so the local work size has to divide the
+ * global work size just like for a single device.
+ *
+ * Note that get_global_size() inside the kernel returns the size of the
+ * slice, so kernels have to be written in terms of get_global_id() and an
+ * explicit problem size.
+ *
+ * In STATIC mode the slices are proportional to the weights given to add().
+ * In ADAPTIVE mode the throughput (work-items per second) of each device is
+ * measured at every launch and the next launch is split according to the
+ * smoothed throughput. The weights are used until every device has been
+ * measured once.
+ */
+struct DevicePartition
+{
+	enum Mode {
+		STATIC,
+		ADAPTIVE
+	};
+
+
+	/**
+	 * measured throughput, shared with the completion callbacks
+	 */
+	struct Rates
+	{
+		std::mutex lock;
+		std::vector<double> rate;
+	};
+
+
+	/**
+	 * joins the events of all slices into one user event
+	 */
+	struct Join
+	{
+		std::atomic<int> remaining;
+		std::atomic<cl_int> status;
+		cl_event done;
+
+
+		Join (int n, cl_event done)
+			: remaining(n)
+			, status(CL_COMPLETE)
+			, done(done)
+		{}
+
+
+		void
+		finish (cl_int s)
+		{
+			if (s < 0) {
+				cl_int ok = CL_COMPLETE;
+				status.compare_exchange_strong(ok, s);
+			}
+			if (--remaining == 0 && done) {
+				clSetUserEventStatus(done, status);
+				clReleaseEvent(done);
+			}
+		}
+	};
+
+
+	Mode mode;
+
+	//! weight of the newest measurement in ADAPTIVE mode
+	double smoothing;
+
+	std::vector<cl_command_queue> queues;
+	std::vector<double> weights;
+	std::shared_ptr<Rates> rates;
+
+
+	DevicePartition (Mode mode = STATIC, double smoothing = 0.5)
+		: mode(mode)
+		, smoothing(smoothing)
+		, rates(new Rates)
+	{}
+
+
+	/**
+	 * add the queue of a device. all queues have to belong to the same
+	 * context and must outlive the DevicePartition
+	 */
+	void
+	add (const CommandQueue &q, double weight = 1.0)
+	{
+		add(q(), weight);
+	}
+
+
+	void
+	add (cl_command_queue q, double weight = 1.0)
+	{
+		std::lock_guard<std::mutex> l(rates->lock);
+		queues.push_back(q);
+		weights.push_back(weight);
+		rates->rate.push_back(0.0);
+	}
+
+
+	/**
+	 * compute the number of work-items per device for @n work-items in
+	 * units of @granularity. the remainder of the division goes to the
+	 * devices with the largest fractional share
+	 */
+	void
+	split (size_t n, size_t granularity, std::vector<size_t> &sizes)
+	{
+		std::vector<double> w = weights;
+		if (mode == ADAPTIVE) {
+			std::lock_guard<std::mutex> l(rates->lock);
+			bool measured = true;
+			for (size_t i = 0; i < w.size(); i++)
+				measured = measured && rates->rate[i] > 0.0;
+			if (measured)
+				w = rates->rate;
+		}
+
+		double total = 0.0;
+		for (size_t i = 0; i < w.size(); i++)
+			total += w[i];
+
+		size_t units = n / granularity;
+		size_t assigned = 0;
+		std::vector<double> frac(w.size());
+		sizes.resize(w.size());
+		for (size_t i = 0; i < w.size(); i++) {
+			double share = total > 0.0 ? units * w[i] / total
+						   : (double)units / w.size();
+			sizes[i] = (size_t)share;
+			frac[i] = share - sizes[i];
+			assigned += sizes[i];
+		}
+		for (; assigned < units; assigned++) {
+			size_t best = 0;
+			for (size_t i = 1; i < frac.size(); i++)
+				if (frac[i] > frac[best])
+					best = i;
+			sizes[best]++;
+			frac[best] = -1.0;
+		}
+		for (size_t i = 0; i < sizes.size(); i++)
+			sizes[i] *= granularity;
+	}
+
+
+	/**
+	 * run @kernel over a 1-D or 2-D range on all devices. @event receives
+	 * a user event that completes when all slices have completed (or fails
+	 * with the first error of a slice)
+	 */
+	cl_int
+	run (Kernel &kernel, cl_uint work_dim, const size_t *global_work_size,
+			const size_t *local_work_size,
+			const EventList &wait = EventList(), Event *event = NULL,
+			const size_t *global_work_offset = NULL)
+	{
+		if (queues.empty())
+			return CL_INVALID_COMMAND_QUEUE;
+		if (work_dim < 1 || work_dim > 2)
+			return CL_INVALID_WORK_DIMENSION;
+
+		// split along the outermost dimension
+		const cl_uint d = work_dim - 1;
+		size_t granularity = local_work_size ? local_work_size[d] : 1;
+		if (!granularity || global_work_size[d] % granularity)
+			return CL_INVALID_WORK_GROUP_SIZE;
+
+		std::vector<size_t> sizes;
+		split(global_work_size[d], granularity, sizes);
+
+		cl_int err;
+		cl_event done = NULL;
+		if (event) {
+			cl_context ctx;
+			err = clGetCommandQueueInfo(queues[0], CL_QUEUE_CONTEXT,
+					sizeof(ctx), &ctx, NULL);
+			if (err != CL_SUCCESS)
+				return err;
+			done = clCreateUserEvent(ctx, &err);
+			if (err != CL_SUCCESS)
+				return err;
+			clRetainEvent(done);
+		}
+
+		// the additional count is held by this function until all
+		// slices are enqueued
+		std::shared_ptr<Join> join(new Join(sizes.size() + 1, done));
+
+		size_t offset[2] = {0, 0}, global[2];
+		if (global_work_offset)
+			for (cl_uint i = 0; i < work_dim; i++)
+				offset[i] = global_work_offset[i];
+		for (cl_uint i = 0; i < work_dim; i++)
+			global[i] = global_work_size[i];
+
+		size_t items = work_dim == 2 ? global_work_size[0] : 1;
+		err = CL_SUCCESS;
+		size_t i = 0;
+		for (; i < sizes.size(); i++) {
+			if (!sizes[i]) {
+				join->finish(CL_COMPLETE);
+				continue;
+			}
+
+			global[d] = sizes[i];
+			Event e;
+			err = kernel.run(queues[i], work_dim, global,
+					local_work_size, wait, &e, offset);
+			offset[d] += sizes[i];
+			if (err != CL_SUCCESS) {
+				join->finish(err);
+				break;
+			}
+
+			std::shared_ptr<Rates> r = rates;
+			double n = (double)(items * sizes[i]);
+			double alpha = smoothing;
+			std::chrono::steady_clock::time_point t0 =
+				std::chrono::steady_clock::now();
+			err = e.on_status([join, r, i, n, alpha, t0] (cl_int s) {
+				std::chrono::duration<double> dt =
+					std::chrono::steady_clock::now() - t0;
+				if (s == CL_COMPLETE && dt.count() > 0.0) {
+					std::lock_guard<std::mutex> l(r->lock);
+					double rate = n / dt.count();
+					double &old = r->rate[i];
+					old = old > 0.0
+					    ? alpha * rate + (1.0 - alpha) * old
+					    : rate;
+				}
+				join->finish(s);
+			});
+			clFlush(queues[i]);
+			if (err != CL_SUCCESS) {
+				join->finish(err);
+				break;
+			}
+		}
+
+		// slices that were never enqueued
+		for (i++; i < sizes.size(); i++)
+			join->finish(err);
+
+		// @wait may hold the caller's previous event, so it is only
+		// replaced once every slice has been enqueued
+		if (event)
+			event->reset(done);
+		join->finish(err == CL_SUCCESS ? CL_COMPLETE : err);
+		return err;
+	}
+};
+
+
+/**
+ * struct LaunchConfig - 1-D launch configuration found by the AutoTuner
+ *
+ * @global:	global work size, 0 if the global work size is given by the
+ *		problem size
+ * @local:	local work size, 0 to let the implementation decide
+ */
+struct LaunchConfig
+{
+	size_t global;
+	size_t local;
+
+
+	LaunchConfig (size_t global = 0, size_t local = 0)
+		: global(global)
+		, local(local)
+	{}
+};
+
+
+/**
+ * struct AutoTuner - finds and remembers 1-D launch configurations.
+ *
+ * Configurations are stored per kernel name, device (name and driver version)
+ * and problem size bucket (the next power of two of the problem size). When
+ * there is no configuration for a launch yet, local work sizes that are
+ * multiples of CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE up to
+ * CL_KERNEL_WORK_GROUP_SIZE are timed. For grid-stride kernels, in which every
+ * work-item loops over the problem with a stride of get_global_size(0), the
+ * global work size is tuned as well. Otherwise the global work size is the
+ * problem size and only local work sizes that divide it are considered.
+ *
+ * Tuning runs the kernel several times with the arguments that are currently
+ * set, so the kernel must not depend on its previous results. Timings are
+ * taken from profiling events if the queue was created with
+ * CL_QUEUE_PROFILING_ENABLE and measured on the host otherwise.
+ *
+ * @fname:		file the configurations are persisted in
+ * @repetitions:	number of timed runs per candidate
+ */
+struct AutoTuner
+{
+	typedef std::tuple<cl_kernel, cl_device_id, size_t> handle_key;
+
+	std::string fname;
+	int repetitions;
+
+	//! persisted configurations by "kernel\tdevice\tbucket"
+	std::map<std::string, LaunchConfig> table;
+
+	//! lookups by handle, to avoid string operations for every launch
+	std::map<handle_key, LaunchConfig> resolved;
+
+
+	explicit
+	AutoTuner (const char *fname = NULL, int repetitions = 5)
+		: fname(fname ? fname : "")
+		, repetitions(repetitions)
+	{}
+
+
+	static size_t
+	bucket (size_t n)
+	{
+		// sizes above the largest power of two share its bucket
+		const size_t top = ~(~(size_t)0 >> 1);
+		if (n > top)
+			return top;
+
+		size_t b = 1;
+		while (b < n)
+			b <<= 1;
+		return b;
+	}
+
+
+	/**
+	 * read configurations from the file. a missing file is not an error
+	 */
+	cl_int
+	load ()
+	{
+		std::ifstream f(fname.c_str());
+		if (!f.is_open())
+			return CL_SUCCESS;
+
+		std::string line;
+		while (std::getline(f, line)) {
+			// kernel, device, bucket, global, local
+			size_t p[4];
+			p[0] = line.find('\t');
+			for (int i = 1; i < 4 && p[i - 1] != std::string::npos; i++)
+				p[i] = line.find('\t', p[i - 1] + 1);
+			if (p[0] == std::string::npos || p[3] == std::string::npos)
+				continue;
+
+			LaunchConfig c(strtoull(line.c_str() + p[2] + 1, NULL, 10),
+				strtoull(line.c_str() + p[3] + 1, NULL, 10));
+			table[line.substr(0, p[2])] = c;
+		}
+		resolved.clear();
+		return CL_SUCCESS;
+	}
+
+
+	cl_int
+	save () const
+	{
+		if (fname.empty())
+			return CL_SUCCESS;
+
+		std::string tmpname = temp_name(fname);
+		std::ofstream f(tmpname.c_str(), std::ios::trunc);
+		if (!f.is_open())
+			return CL_INVALID_VALUE;
+		std::map<std::string, LaunchConfig>::const_iterator it;
+		for (it = table.begin(); it != table.end(); ++it)
+			f << it->first << '\t' << it->second.global << '\t'
+			  << it->second.local << '\n';
+		f.close();
+		if (!f || std::rename(tmpname.c_str(), fname.c_str())) {
+			std::remove(tmpname.c_str());
+			return CL_INVALID_VALUE;
+		}
+		return CL_SUCCESS;
+	}
+
+
+	static cl_int
+	key (cl_kernel kernel, cl_device_id device, size_t n, std::string *key)
+	{
+		size_t len = 0;
+		cl_int err = clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, 0,
+				NULL, &len);
+		if (err != CL_SUCCESS || !len)
+			return err != CL_SUCCESS ? err : CL_INVALID_KERNEL;
+
+		std::vector<char> name(len);
+		err = clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, len,
+				&name[0], NULL);
+		if (err != CL_SUCCESS)
+			return err;
+
+		char b[32];
+		snprintf(b, sizeof(b), "%llu", (unsigned long long)bucket(n));
+		*key = std::string(&name[0]) + '\t'
+		     + device_info_string(device, CL_DEVICE_NAME) + ' '
+		     + device_info_string(device, CL_DRIVER_VERSION) + '\t' + b;
+		return CL_SUCCESS;
+	}
+
+
+	/**
+	 * run the kernel once with the given configuration and return the
+	 * execution time in nanoseconds
+	 */
+	cl_int
+	time (Kernel &kernel, const cl_command_queue q, size_t global,
+			size_t local, cl_ulong *ns)
+	{
+		Event e;
+		EventTimes t;
+		std::chrono::steady_clock::time_point t0 =
+			std::chrono::steady_clock::now();
+		cl_int err = kernel.run(q, 1, &global, local ? &local : NULL,
+				EventList(), &e);
+		if (err == CL_SUCCESS)
+			err = e.wait();
+		if (err != CL_SUCCESS)
+			return err;
+
+		if (e.times(&t) == CL_SUCCESS) {
+			*ns = t.exec_time();
+		}
+		else {
+			std::chrono::nanoseconds dt =
+				std::chrono::steady_clock::now() - t0;
+			*ns = dt.count();
+		}
+		return CL_SUCCESS;
+	}
+
+
+	/**
+	 * time candidate configurations for @n work-items and return the
+	 * fastest one in @best
+	 */
+	cl_int
+	tune (Kernel &kernel, const cl_command_queue q, size_t n,
+			bool grid_stride, LaunchConfig *best)
+	{
+		cl_int err;
+		cl_device_id device;
+		size_t wg = 0, multiple = 1;
+		cl_uint cus = 1;
+
+		err = clGetCommandQueueInfo(q, CL_QUEUE_DEVICE, sizeof(device),
+				&device, NULL);
+		if (err == CL_SUCCESS)
+			err = clGetKernelWorkGroupInfo(kernel(), device,
+					CL_KERNEL_WORK_GROUP_SIZE, sizeof(wg),
+					&wg, NULL);
+		if (err == CL_SUCCESS)
+			err = device_info(device, CL_DEVICE_MAX_COMPUTE_UNITS,
+					&cus);
+		if (err != CL_SUCCESS)
+			return CL_INVALID_KERNEL;
+		// OpenCL 1.1 query
+		clGetKernelWorkGroupInfo(kernel(), device,
+				CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+				sizeof(multiple), &multiple, NULL);
+		if (!multiple)
+			multiple = 1;
+
+		std::vector<LaunchConfig> candidates;
+		for (size_t l = multiple; l <= wg && l <= n; l *= 2) {
+			if (!grid_stride) {
+				if (n % l == 0)
+					candidates.push_back(LaunchConfig(0, l));
+				continue;
+			}
+			for (size_t f = 1; f <= 64; f *= 4) {
+				size_t g = f * cus * l;
+				if (g > n)
+					break;
+				candidates.push_back(LaunchConfig(g, l));
+			}
+		}
+		if (candidates.empty()) {
+			*best = LaunchConfig(grid_stride ? n : 0, 0);
+			return CL_SUCCESS;
+		}
+
+		cl_ulong best_ns = ~(cl_ulong)0;
+		for (size_t i = 0; i < candidates.size(); i++) {
+			size_t g = candidates[i].global ? candidates[i].global : n;
+			cl_ulong ns = 0, min_ns = ~(cl_ulong)0;
+
+			// the first run is a warm-up
+			err = time(kernel, q, g, candidates[i].local, &ns);
+			for (int r = 0; r < repetitions && err == CL_SUCCESS; r++) {
+				err = time(kernel, q, g, candidates[i].local, &ns);
+				if (ns < min_ns)
+					min_ns = ns;
+			}
+			if (err != CL_SUCCESS)
+				continue;
+			if (min_ns < best_ns) {
+				best_ns = min_ns;
+				*best = candidates[i];
+			}
+		}
+		return best_ns == ~(cl_ulong)0 ? CL_INVALID_WORK_GROUP_SIZE
+					       : CL_SUCCESS;
+	}
+
+
+	/**
+	 * get the configuration for a launch, tune it if there is none yet.
+	 * tuning needs the input of the kernel, so it waits for @wait first.
+	 * unless @grid_stride is set, the local work size of @config divides @n
+	 */
+	cl_int
+	lookup (Kernel &kernel, const cl_command_queue q, size_t n,
+			bool grid_stride, LaunchConfig *config,
+			const EventList &wait = EventList())
+	{
+		cl_int err;
+		cl_device_id device;
+
+		err = clGetCommandQueueInfo(q, CL_QUEUE_DEVICE, sizeof(device),
+				&device, NULL);
+		if (err != CL_SUCCESS)
+			return err;
+
+		handle_key hk(kernel(), device, bucket(n));
+		std::map<handle_key, LaunchConfig>::iterator r = resolved.find(hk);
+		if (r != resolved.end()) {
+			*config = r->second;
+			return CL_SUCCESS;
+		}
+
+		std::string k;
+		err = key(kernel(), device, n, &k);
+		if (err != CL_SUCCESS)
+			return err;
+
+		std::map<std::string, LaunchConfig>::iterator it = table.find(k);
+		if (it == table.end()) {
+			LaunchConfig c;
+			err = wait.wait();
+			if (err == CL_SUCCESS)
+				err = tune(kernel, q, n, grid_stride, &c);
+			if (err != CL_SUCCESS)
+				return err;
+			it = table.insert(std::make_pair(k, c)).first;
+			save();
+		}
+
+		resolved[hk] = it->second;
+		*config = it->second;
+
+		// the configuration was tuned for another size of the bucket, so
+		// its local work size need not divide @n. fall back to the
+		// largest power of two fraction of it that does, or let the
+		// implementation decide
+		if (!grid_stride && config->local && n % config->local) {
+			size_t l = config->local / 2;
+			while (l > 1 && n % l)
+				l /= 2;
+			config->local = l > 1 ? l : 0;
+		}
+		return CL_SUCCESS;
+	}
+
+
+	/**
+	 * launch a kernel with the tuned configuration for @n work-items.
+	 * @used receives the configuration, e.g. to know the number of partial
+	 * results of a grid-stride kernel
+	 */
+	cl_int
+	run (Kernel &kernel, const cl_command_queue q, size_t n,
+			bool grid_stride = false,
+			const EventList &wait = EventList(), Event *event = NULL,
+			LaunchConfig *used = NULL)
+	{
+		LaunchConfig c;
+		cl_int err = lookup(kernel, q, n, grid_stride, &c, wait);
+		if (err != CL_SUCCESS)
+			return err;
+		if (!c.global)
+			c.global = n;
+		if (used)
+			*used = c;
+
+		return kernel.run(q, 1, &c.global, c.local ? &c.local : NULL,
+				wait, event);
+	}
+
+
+	cl_int
+	run (Kernel &kernel, const CommandQueue &q, size_t n,
+			bool grid_stride = false,
+			const EventList &wait = EventList(), Event *event = NULL,
+			LaunchConfig *used = NULL)
+	{
+		return run(kernel, q(), n, grid_stride, wait, event, used);
+	}
+};
+
+
+/**
+ * struct AlignedAllocator - STL allocator for page-aligned host memory.
+ *
+ * Memory from this allocator can be wrapped by Buffer<T>::useHostPtr without
+ * a copy: OpenCL implementations on CPUs and integrated GPUs use host memory
+ * in place when it is aligned to a page and its size is a multiple of the
+ * cache line size, so allocations are padded to whole pages.
+ *
+ *	std::vector<float, AlignedAllocator<float>> data(n);
+ *	buffer.useHostPtr(ctx, &data[0], n * sizeof(float));
+ */
+template <typename T, size_t Alignment = 4096>
+struct AlignedAllocator
+{
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+
+	template <typename U>
+	struct rebind
+	{
+		typedef AlignedAllocator<U, Alignment> other;
+	};
+
+
+	AlignedAllocator () {}
+
+	template <typename U>
+	AlignedAllocator (const AlignedAllocator<U, Alignment> &) {}
+
+
+	T*
+	allocate (size_t n, const void * = 0)
+	{
+		void *p = NULL;
+		size_t bytes = (n * sizeof(T) + Alignment - 1) / Alignment
+			* Alignment;
+		if (posix_memalign(&p, Alignment, bytes ? bytes : Alignment))
+			throw std::bad_alloc();
+		return (T*)p;
+	}
+
+
+	void
+	deallocate (T *p, size_t)
+	{
+		free(p);
+	}
+
+
+	size_t
+	max_size () const
+	{
+		return ((size_t)-1 - Alignment) / sizeof(T);
+	}
+
+
+	template <typename U, typename... Args>
+	void
+	construct (U *p, Args&&... args)
+	{
+		new ((void*)p) U(std::forward<Args>(args)...);
+	}
+
+
+	template <typename U>
+	void
+	destroy (U *p)
+	{
+		p->~U();
+	}
+};
+
+
+template <typename T, typename U, size_t A>
+inline bool
+operator== (const AlignedAllocator<T, A> &, const AlignedAllocator<U, A> &)
+{
+	return true;
+}
+
+
+template <typename T, typename U, size_t A>
+inline bool
+operator!= (const AlignedAllocator<T, A> &, const AlignedAllocator<U, A> &)
+{
+	return false;
+}
+
+
+/**
+ * struct Rect - a box of @width x @height x @depth elements at (@x, @y, @z)
+ * in a 2D or 3D array with rows @row_pitch and slices @slice_pitch elements
+ * apart. a pitch of 0 means the array is exactly as wide (high) as the box.
+ *
+ *	// 64x64 tile at (128, 32) of a 1024 elements wide matrix
+ *	Rect tile = Rect(64, 64).at(128, 32).pitch(1024);
+ */
+struct Rect
+{
+	size_t x, y, z;
+	size_t width, height, depth;
+	size_t row_pitch, slice_pitch;
+
+
+	Rect (size_t width = 0, size_t height = 1, size_t depth = 1)
+		: x(0), y(0), z(0)
+		, width(width), height(height), depth(depth)
+		, row_pitch(0), slice_pitch(0)
+	{}
+
+
+	Rect&
+	at (size_t x, size_t y = 0, size_t z = 0)
+	{
+		this->x = x;
+		this->y = y;
+		this->z = z;
+		return *this;
+	}
+
+
+	Rect&
+	pitch (size_t row_pitch, size_t slice_pitch = 0)
+	{
+		this->row_pitch = row_pitch;
+		this->slice_pitch = slice_pitch;
+		return *this;
+	}
+
+
+	size_t
+	count () const
+	{
+		return width * height * depth;
+	}
+};
+
+
+template <typename T>
+struct Buffer: CLObjContainer<cl_mem, clReleaseMemObject>
+	       , CommandQueueJunction
+{
+	//! mapping pointer
+	T *ptr;
+
+	//! size of memory buffer object
+	size_t size;
+
+
+	Buffer (cl_mem buffer = NULL, bool release_on_destroy = true)
+		: CLObjContainer(buffer, release_on_destroy)
+		, ptr(NULL)
+		, size(0)
+	{}
+
+
+	Buffer (Buffer &&other)
+		: CLObjContainer(std::move(other))
+		, CommandQueueJunction(other)
+		, ptr(other.ptr)
+		, size(other.size)
+	{
+		other.ptr = NULL;
+		other.size = 0;
+	}
+
+
+	Buffer&
+	operator= (Buffer &&other)
+	{
+		if (this != &other) {
+			CLObjContainer::operator=(std::move(other));
+			CommandQueueJunction::operator=(other);
+			ptr = other.ptr;
+			size = other.size;
+			other.ptr = NULL;
+			other.size = 0;
+		}
+		return *this;
+	}
+
+
+	cl_int
+	mallocHost (const cl_context ctx, size_t size,
+			cl_mem_flags flags = CL_MEM_READ_WRITE)
+	{
+		cl_int err;
+		cl_obj = clCreateBuffer(ctx,
+				CL_MEM_ALLOC_HOST_PTR | flags, size, NULL,
+				&err);
+		this->size = size;
+		return err;
+	}
+
+
+	cl_int
+	mallocHost (const Context &ctx, size_t size,
+			cl_mem_flags flags = CL_MEM_READ_WRITE)
+	{
+		return mallocHost(ctx(), size, flags);
+	}
+
+
+
+	cl_int
+	mallocDevice (const cl_context ctx, size_t size,
+			cl_mem_flags flags = CL_MEM_READ_WRITE)
+	{
+		cl_int err;
+		cl_obj = clCreateBuffer(ctx, flags, size, NULL, &err);
+		this->size = size;
+		return err;
+	}
+
+
+	cl_int
+	mallocDevice (const Context &ctx, size_t size,
+			cl_mem_flags flags = CL_MEM_READ_WRITE)
+	{
+		return mallocDevice(ctx(), size, flags);
+	}
+
+
+	/**
+	 * wrap existing host memory with CL_MEM_USE_HOST_PTR. with page-aligned
+	 * memory (see AlignedAllocator) devices that share memory with the host
+	 * use it without copying and mapping the buffer returns @host. the
+	 * memory has to stay valid as long as the buffer exists
+	 */
+	cl_int
+	useHostPtr (const cl_context ctx, T *host, size_t size,
+			cl_mem_flags flags = CL_MEM_READ_WRITE)
+	{
+		cl_int err;
+		cl_obj = clCreateBuffer(ctx, CL_MEM_USE_HOST_PTR | flags, size,
+				host, &err);
+		this->size = size;
+		return err;
+	}
+
+
+	cl_int
+	useHostPtr (const Context &ctx, T *host, size_t size,
+			cl_mem_flags flags = CL_MEM_READ_WRITE)
+	{
+		return useHostPtr(ctx(), host, size, flags);
+	}
+
+
+	template <typename Alloc>
+	cl_int
+	useHostPtr (const cl_context ctx, std::vector<T, Alloc> &host,
+			cl_mem_flags flags = CL_MEM_READ_WRITE)
+	{
+		if (host.empty())
+			return CL_INVALID_BUFFER_SIZE;
+		return useHostPtr(ctx, &host[0], host.size() * sizeof(T), flags);
+	}
+
+
+	template <typename Alloc>
+	cl_int
+	useHostPtr (const Context &ctx, std::vector<T, Alloc> &host,
+			cl_mem_flags flags = CL_MEM_READ_WRITE)
+	{
+		return useHostPtr(ctx(), host, flags);
+	}
+
+
+
+	T*
+	map (const cl_command_queue q, cl_int *err = NULL,
+			cl_map_flags flags = CL_MAP_READ | CL_MAP_WRITE,
+			cl_bool blocked = true)
+	{
+		cl_int e;
+		TraceScope trace("map", "map", q, NULL, this->size);
+		ptr = (T*)clEnqueueMapBuffer(q, this->cl_obj, blocked, flags, 0,
+				this->size, 0, NULL, trace.event(), &e);
+		if (err)
+			*err = e;
+		return ptr;
+	}
+
+
+	T*
+	map (const CommandQueue &q, cl_int *err = NULL,
+			cl_map_flags flags = CL_MAP_READ | CL_MAP_WRITE,
+			cl_bool blocked = true)
+	{
+		return this->map(q(), err, flags, blocked);
+	}
+
+
+	/**
+	 * map the buffer after all events in @wait have finished. the mapping
+	 * is non-blocking by default, so the returned pointer may only be
+	 * accessed after @event has completed
+	 */
+	T*
+	map (const cl_command_queue q, const EventList &wait, Event *event,
+			cl_int *err = NULL,
+			cl_map_flags flags = CL_MAP_READ | CL_MAP_WRITE,
+			cl_bool blocked = false)
+	{
+		cl_int e;
+		EventSlot slot(event);
+		TraceScope trace("map", "map", q, slot, this->size);
+		ptr = (T*)clEnqueueMapBuffer(q, this->cl_obj, blocked, flags, 0,
+				this->size, wait.size(), wait.data(),
+				trace.event(), &e);
+		if (err)
+			*err = e;
+		return ptr;
+	}
+
+
+	T*
+	map (const CommandQueue &q, const EventList &wait, Event *event,
+			cl_int *err = NULL,
+			cl_map_flags flags = CL_MAP_READ | CL_MAP_WRITE,
+			cl_bool blocked = false)
+	{
+		return this->map(q(), wait, event, err, flags, blocked);
+	}
+
+
+	cl_int
+	unmap (const cl_command_queue q, cl_event *event = NULL)
+	{
+		TraceScope trace("map", "unmap", q, event, this->size);
+		return clEnqueueUnmapMemObject(q, this->cl_obj, (void*)ptr, 0,
+				NULL, trace.event());
+	}
+
+
+	cl_int
+	unmap (const CommandQueue &q, cl_event *event = NULL)
+	{
+		return this->unmap(q(), event);
+	}
+
+
+	/**
+	 * unmap the buffer after all events in @wait have finished
+	 */
+	cl_int
+	unmap (const cl_command_queue q, const EventList &wait, Event *event)
+	{
+		EventSlot slot(event);
+		TraceScope trace("map", "unmap", q, slot, this->size);
+		return clEnqueueUnmapMemObject(q, this->cl_obj, (void*)ptr,
+				wait.size(), wait.data(), trace.event());
+	}
+
+
+	cl_int
+	unmap (const CommandQueue &q, const EventList &wait, Event *event)
+	{
+		return this->unmap(q(), wait, event);
+	}
+
+
+	/**
+	 * read @size bytes starting at @offset from the buffer into host memory.
+	 * the read is non-blocking unless @blocked is set, so @dst may only be
+	 * accessed after @event has completed
+	 */
+	cl_int
+	read (const cl_command_queue q, T *dst,
+			const EventList &wait = EventList(), Event *event = NULL,
+			size_t size = 0, size_t offset = 0,
+			cl_bool blocked = false)
+	{
+		if (size == 0)
+			size = this->size;
+
+		EventSlot slot(event);
+		TraceScope trace("transfer", "read", q, slot, size);
+		return clEnqueueReadBuffer(q, this->cl_obj, blocked, offset,
+				size, dst, wait.size(), wait.data(),
+				trace.event());
+	}
+
+
+	cl_int
+	read (const CommandQueue &q, T *dst,
+			const EventList &wait = EventList(), Event *event = NULL,
+			size_t size = 0, size_t offset = 0,
+			cl_bool blocked = false)
+	{
+		return read(q(), dst, wait, event, size, offset, blocked);
+	}
+
+
+	/**
+	 * write @size bytes from host memory to the buffer at @offset. the write
+	 * is non-blocking unless @blocked is set, so @src has to stay valid
+	 * until @event has completed
+	 */
+	cl_int
+	write (const cl_command_queue q, const T *src,
+			const EventList &wait = EventList(), Event *event = NULL,
+			size_t size = 0, size_t offset = 0,
+			cl_bool blocked = false)
+	{
+		if (size == 0)
+			size = this->size;
+
+		EventSlot slot(event);
+		TraceScope trace("transfer", "write", q, slot, size);
+		return clEnqueueWriteBuffer(q, this->cl_obj, blocked, offset,
+				size, src, wait.size(), wait.data(),
+				trace.event());
+	}
+
+
+	cl_int
+	write (const CommandQueue &q, const T *src,
+			const EventList &wait = EventList(), Event *event = NULL,
+			size_t size = 0, size_t offset = 0,
+			cl_bool blocked = false)
+	{
+		return write(q(), src, wait, event, size, offset, blocked);
+	}
+
+
+
+	// TODO: provide operator= for copy operation
+	cl_int
+	copy_to (const cl_command_queue q, Buffer<T> &buffer, size_t size = 0,
+		size_t src_offset = 0, size_t dst_offset = 0)
+	{
+		if (size == 0)
+			size = this->size;
+
+		TraceScope trace("transfer", "copy", q, NULL, size);
+		return clEnqueueCopyBuffer(q, this->cl_obj, buffer(),
+				src_offset, dst_offset, size, 0, NULL,
+				trace.event());
+	}
+
+
+	cl_int
+	copy_to (const CommandQueue &q, Buffer<T> &buffer, size_t size = 0,
+		size_t src_offset = 0, size_t dst_offset = 0)
+	{
+		return copy_to(q(), buffer, size, src_offset, dst_offset);
+	}
+
+
+	/**
+	 * copy_to function when the buffer is already bound to a command queue
+	 */
+	cl_int
+	copy_to (Buffer<T> &buffer, size_t size = 0, size_t src_offset = 0,
+			size_t dst_offset = 0)
+	{
+		if (!(this->command_queue))
+			return CL_INVALID_COMMAND_QUEUE;
+
+		return copy_to(*(this->command_queue), buffer, size, src_offset,
+				dst_offset);
+	}
+
+
+	/**
+	 * copy to another buffer after all events in @wait have finished. the
+	 * event of the copy operation is stored in @event
+	 */
+	cl_int
+	copy_to (const cl_command_queue q, Buffer<T> &buffer,
+			const EventList &wait, Event *event, size_t size = 0,
+			size_t src_offset = 0, size_t dst_offset = 0)
+	{
+		if (size == 0)
+			size = this->size;
+
+		EventSlot slot(event);
+		TraceScope trace("transfer", "copy", q, slot, size);
+		return clEnqueueCopyBuffer(q, this->cl_obj, buffer(),
+				src_offset, dst_offset, size, wait.size(),
+				wait.data(), trace.event());
+	}
+
+
+	cl_int
+	copy_to (const CommandQueue &q, Buffer<T> &buffer,
+			const EventList &wait, Event *event, size_t size = 0,
+			size_t src_offset = 0, size_t dst_offset = 0)
+	{
+		return copy_to(q(), buffer, wait, event, size, src_offset,
+				dst_offset);
+	}
+
+
+	cl_int
+	copy_to (Buffer<T> &buffer, const EventList &wait, Event *event,
+			size_t size = 0, size_t src_offset = 0,
+			size_t dst_offset = 0)
+	{
+		if (!(this->command_queue))
+			return CL_INVALID_COMMAND_QUEUE;
+
+		return copy_to(*(this->command_queue), buffer, wait, event,
+				size, src_offset, dst_offset);
+	}
+
+
+	/**
+	 * read the box @src of the buffer into host memory at @dst, where it is
+	 * placed according to @dst_rect. the extent is taken from @src and the
+	 * extent of @dst_rect is ignored. like read, the transfer is
+	 * non-blocking unless @blocked is set
+	 */
+	cl_int
+	read_rect (const cl_command_queue q, T *dst, const Rect &src,
+			const Rect &dst_rect, const EventList &wait = EventList(),
+			Event *event = NULL, cl_bool blocked = false)
+	{
+		size_t buffer_origin[3], host_origin[3], region[3];
+		rect_bytes(src, buffer_origin, region);
+		rect_bytes(dst_rect, host_origin, NULL);
+
+		EventSlot slot(event);
+		TraceScope trace("transfer", "read_rect", q, slot,
+				src.count() * sizeof(T));
+		return clEnqueueReadBufferRect(q, this->cl_obj, blocked,
+				buffer_origin, host_origin, region,
+				src.row_pitch * sizeof(T),
+				src.slice_pitch * sizeof(T),
+				dst_rect.row_pitch * sizeof(T),
+				dst_rect.slice_pitch * sizeof(T), dst,
+				wait.size(), wait.data(), trace.event());
+	}
+
+
+	cl_int
+	read_rect (const CommandQueue &q, T *dst, const Rect &src,
+			const Rect &dst_rect, const EventList &wait = EventList(),
+			Event *event = NULL, cl_bool blocked = false)
+	{
+		return read_rect(q(), dst, src, dst_rect, wait, event, blocked);
+	}
+
+
+	/**
+	 * read the box @src of the buffer into tightly packed host memory
+	 */
+	cl_int
+	read_rect (const cl_command_queue q, T *dst, const Rect &src,
+			const EventList &wait = EventList(), Event *event = NULL,
+			cl_bool blocked = false)
+	{
+		return read_rect(q, dst, src, Rect(), wait, event, blocked);
+	}
+
+
+	cl_int
+	read_rect (const CommandQueue &q, T *dst, const Rect &src,
+			const EventList &wait = EventList(), Event *event = NULL,
+			cl_bool blocked = false)
+	{
+		return read_rect(q(), dst, src, Rect(), wait, event, blocked);
+	}
+
+
+	/**
+	 * write the box @src_rect of host memory at @src into the buffer, where
+	 * it is placed according to @dst. the extent is taken from @src_rect
+	 * and the extent of @dst is ignored. like write, the transfer is
+	 * non-blocking unless @blocked is set
+	 */
+	cl_int
+	write_rect (const cl_command_queue q, const T *src,
+			const Rect &src_rect, const Rect &dst,
+			const EventList &wait = EventList(), Event *event = NULL,
+			cl_bool blocked = false)
+	{
+		size_t buffer_origin[3], host_origin[3], region[3];
+		rect_bytes(src_rect, host_origin, region);
+		rect_bytes(dst, buffer_origin, NULL);
+
+		EventSlot slot(event);
+		TraceScope trace("transfer", "write_rect", q, slot,
+				src_rect.count() * sizeof(T));
+		return clEnqueueWriteBufferRect(q, this->cl_obj, blocked,
+				buffer_origin, host_origin, region,
+				dst.row_pitch * sizeof(T),
+				dst.slice_pitch * sizeof(T),
+				src_rect.row_pitch * sizeof(T),
+				src_rect.slice_pitch * sizeof(T), src,
+				wait.size(), wait.data(), trace.event());
+	}
+
+
+	cl_int
+	write_rect (const CommandQueue &q, const T *src,
+			const Rect &src_rect, const Rect &dst,
+			const EventList &wait = EventList(), Event *event = NULL,
+			cl_bool blocked = false)
+	{
+		return write_rect(q(), src, src_rect, dst, wait, event,
+				blocked);
+	}
+
+
+	/**
+	 * write tightly packed host memory into the box @dst of the buffer
+	 */
+	cl_int
+	write_rect (const cl_command_queue q, const T *src, const Rect &dst,
+			const EventList &wait = EventList(), Event *event = NULL,
+			cl_bool blocked = false)
+	{
+		Rect packed(dst.width, dst.height, dst.depth);
+		return write_rect(q, src, packed, dst, wait, event, blocked);
+	}
+
+
+	cl_int
+	write_rect (const CommandQueue &q, const T *src, const Rect &dst,
+			const EventList &wait = EventList(), Event *event = NULL,
+			cl_bool blocked = false)
+	{
+		return write_rect(q(), src, dst, wait, event, blocked);
+	}
+
+
+	/**
+	 * copy the box @src of this buffer into @buffer, where it is placed
+	 * according to @dst. the extent is taken from @src
+	 */
+	cl_int
+	copy_rect_to (const cl_command_queue q, Buffer<T> &buffer,
+			const Rect &src, const Rect &dst,
+			const EventList &wait = EventList(), Event *event = NULL)
+	{
+		size_t src_origin[3], dst_origin[3], region[3];
+		rect_bytes(src, src_origin, region);
+		rect_bytes(dst, dst_origin, NULL);
+
+		EventSlot slot(event);
+		TraceScope trace("transfer", "copy_rect", q, slot,
+				src.count() * sizeof(T));
+		return clEnqueueCopyBufferRect(q, this->cl_obj, buffer(),
+				src_origin, dst_origin, region,
+				src.row_pitch * sizeof(T),
+				src.slice_pitch * sizeof(T),
+				dst.row_pitch * sizeof(T),
+				dst.slice_pitch * sizeof(T), wait.size(),
+				wait.data(), trace.event());
+	}
+
+
+	cl_int
+	copy_rect_to (const CommandQueue &q, Buffer<T> &buffer,
+			const Rect &src, const Rect &dst,
+			const EventList &wait = EventList(), Event *event = NULL)
+	{
+		return copy_rect_to(q(), buffer, src, dst, wait, event);
+	}
+
+
+	cl_int
+	copy_rect_to (Buffer<T> &buffer, const Rect &src, const Rect &dst,
+			const EventList &wait = EventList(), Event *event = NULL)
+	{
+		if (!(this->command_queue))
+			return CL_INVALID_COMMAND_QUEUE;
+
+		return copy_rect_to(*(this->command_queue), buffer, src, dst,
+				wait, event);
+	}
+
+
+private:
+	/**
+	 * origin and region of @r as the rect functions expect them: the x
+	 * components in bytes, the others in rows and slices
+	 */
+	static void
+	rect_bytes (const Rect &r, size_t origin[3], size_t region[3])
+	{
+		origin[0] = r.x * sizeof(T);
+		origin[1] = r.y;
+		origin[2] = r.z;
+		if (region) {
+			region[0] = r.width * sizeof(T);
+			region[1] = r.height;
+			region[2] = r.depth;
+		}
+	}
+};
+
+
+/**
+ * build an image format from a channel order and a channel data type
+ */
+inline cl_image_format
+image_format (cl_channel_order order, cl_channel_type type)
+{
+	cl_image_format f;
+	f.image_channel_order = order;
+	f.image_channel_data_type = type;
+	return f;
+}
+
+
+/**
+ * get the formats @ctx supports for images of @type (CL_MEM_OBJECT_IMAGE2D
+ * or CL_MEM_OBJECT_IMAGE3D) created with @flags
+ */
+inline cl_int
+supported_image_formats (cl_context ctx, cl_mem_flags flags,
+		cl_mem_object_type type, std::vector<cl_image_format> &formats)
+{
+	cl_int err;
+	cl_uint n = 0;
+
+	formats.clear();
+	err = clGetSupportedImageFormats(ctx, flags, type, 0, NULL, &n);
+	if (err != CL_SUCCESS || !n)
+		return err;
+
+	formats.resize(n);
+	return clGetSupportedImageFormats(ctx, flags, type, n, &formats[0],
+			NULL);
+}
+
+
+inline bool
+image_format_supported (cl_context ctx, cl_mem_flags flags,
+		cl_mem_object_type type, const cl_image_format &format)
+{
+	std::vector<cl_image_format> formats;
+	if (supported_image_formats(ctx, flags, type, formats) != CL_SUCCESS)
+		return false;
+
+	for (size_t i = 0; i < formats.size(); i++)
+		if (formats[i].image_channel_order == format.image_channel_order
+		    && formats[i].image_channel_data_type
+		       == format.image_channel_data_type)
+			return true;
+	return false;
+}
+
+
+/**
+ * size of one pixel of @format in bytes, 0 for unknown formats
+ */
+inline size_t
+image_pixel_size (const cl_image_format &format)
+{
+	size_t channels, bytes;
+
+	switch (format.image_channel_data_type) {
+	case CL_UNORM_SHORT_565:
+	case CL_UNORM_SHORT_555:
+		return 2;
+	case CL_UNORM_INT_101010:
+		return 4;
+	case CL_SNORM_INT8:
+	case CL_UNORM_INT8:
+	case CL_SIGNED_INT8:
+	case CL_UNSIGNED_INT8:
+		bytes = 1;
+		break;
+	case CL_SNORM_INT16:
+	case CL_UNORM_INT16:
+	case CL_SIGNED_INT16:
+	case CL_UNSIGNED_INT16:
+	case CL_HALF_FLOAT:
+		bytes = 2;
+		break;
+	case CL_SIGNED_INT32:
+	case CL_UNSIGNED_INT32:
+	case CL_FLOAT:
+		bytes = 4;
+		break;
+	default:
+		return 0;
+	}
+
+	switch (format.image_channel_order) {
+	case CL_R:
+	case CL_A:
+	case CL_INTENSITY:
+	case CL_LUMINANCE:
+		channels = 1;
+		break;
+	case CL_RG:
+	case CL_RA:
+		channels = 2;
+		break;
+	case CL_RGB:
+		channels = 3;
+		break;
+	case CL_RGBA:
+	case CL_BGRA:
+	case CL_ARGB:
+		channels = 4;
+		break;
+	default:
+		return 0;
+	}
+	return channels * bytes;
+}
+
+
+/**
+ * format for 8 bit RGB data that is read as normalized floats in kernels:
+ * CL_RGB if the context supports it, CL_RGBA otherwise (CL_RGB is only
+ * required for packed data types, so few devices offer it with 8 bits)
+ */
+inline cl_image_format
+rgb8_image_format (cl_context ctx, cl_mem_flags flags = CL_MEM_READ_ONLY,
+		cl_mem_object_type type = CL_MEM_OBJECT_IMAGE2D)
+{
+	cl_image_format rgb = image_format(CL_RGB, CL_UNORM_INT8);
+	if (image_format_supported(ctx, flags, type, rgb))
+		return rgb;
+	return image_format(CL_RGBA, CL_UNORM_INT8);
+}
+
+
+/**
+ * struct Sampler - how kernels read images: coordinate normalization,
+ * addressing outside of the image and filtering
+ */
+struct Sampler : CLObjContainer<cl_sampler, clReleaseSampler>
+{
+	cl_int
+	create (const cl_context ctx, cl_bool normalized = CL_FALSE,
+			cl_addressing_mode addressing = CL_ADDRESS_CLAMP_TO_EDGE,
+			cl_filter_mode filter = CL_FILTER_NEAREST)
+	{
+		cl_int err;
+		reset(clCreateSampler(ctx, normalized, addressing, filter,
+				&err));
+		return err;
+	}
+
+
+	cl_int
+	create (const Context &ctx, cl_bool normalized = CL_FALSE,
+			cl_addressing_mode addressing = CL_ADDRESS_CLAMP_TO_EDGE,
+			cl_filter_mode filter = CL_FILTER_NEAREST)
+	{
+		return create(ctx(), normalized, addressing, filter);
+	}
+};
+
+
+/**
+ * struct Image - two or three dimensional image, use Image2D and Image3D.
+ *
+ * Origins and regions are given in pixels, a NULL origin is the first pixel
+ * and a NULL region the whole image. Images with 8 bit channels can be
+ * uploaded as they are and read as normalized floats in kernels, so there is
+ * no need to convert them to floats on the host.
+ *
+ * @ptr:		mapping pointer
+ * @row_pitch:		bytes between rows of the mapping
+ * @slice_pitch:	bytes between slices of the mapping
+ */
+template <unsigned Dim>
+struct Image : CLObjContainer<cl_mem, clReleaseMemObject>
+	     , CommandQueueJunction
+{
+	size_t width;
+	size_t height;
+	size_t depth;
+	cl_image_format format;
+
+	void *ptr;
+	size_t row_pitch;
+	size_t slice_pitch;
+
+
+	Image (cl_mem image = NULL, bool release_on_destroy = true)
+		: CLObjContainer(image, release_on_destroy)
+		, width(0), height(0), depth(1), ptr(NULL), row_pitch(0)
+		, slice_pitch(0)
+	{
+		format = image_format(0, 0);
+	}
+
+
+	/**
+	 * create a 2D image of @width x @height pixels. @host and @row_pitch
+	 * describe the host memory for CL_MEM_USE_HOST_PTR and
+	 * CL_MEM_COPY_HOST_PTR
+	 */
+	template <unsigned D = Dim>
+	typename std::enable_if<D == 2, cl_int>::type
+	create (const cl_context ctx, size_t width, size_t height,
+			const cl_image_format &format,
+			cl_mem_flags flags = CL_MEM_READ_WRITE,
+			void *host = NULL, size_t row_pitch = 0)
+	{
+		return create_image(ctx, width, height, 1, format, flags, host,
+				row_pitch, 0);
+	}
+
+
+	template <unsigned D = Dim>
+	typename std::enable_if<D == 2, cl_int>::type
+	create (const Context &ctx, size_t width, size_t height,
+			const cl_image_format &format,
+			cl_mem_flags flags = CL_MEM_READ_WRITE,
+			void *host = NULL, size_t row_pitch = 0)
+	{
+		return create(ctx(), width, height, format, flags, host,
+				row_pitch);
+	}
+
+
+	/**
+	 * create a 3D image of @width x @height x @depth pixels
+	 */
+	template <unsigned D = Dim>
+	typename std::enable_if<D == 3, cl_int>::type
+	create (const cl_context ctx, size_t width, size_t height,
+			size_t depth, const cl_image_format &format,
+			cl_mem_flags flags = CL_MEM_READ_WRITE,
+			void *host = NULL, size_t row_pitch = 0,
+			size_t slice_pitch = 0)
+	{
+		return create_image(ctx, width, height, depth, format, flags,
+				host, row_pitch, slice_pitch);
+	}
+
+
+	template <unsigned D = Dim>
+	typename std::enable_if<D == 3, cl_int>::type
+	create (const Context &ctx, size_t width, size_t height,
+			size_t depth, const cl_image_format &format,
+			cl_mem_flags flags = CL_MEM_READ_WRITE,
+			void *host = NULL, size_t row_pitch = 0,
+			size_t slice_pitch = 0)
+	{
+		return create(ctx(), width, height, depth, format, flags, host,
+				row_pitch, slice_pitch);
+	}
+
+
+	size_t
+	pixel_size () const
+	{
+		return image_pixel_size(format);
+	}
+
+
+	/**
+	 * write the pixels of @region at @origin from host memory. the write
+	 * is non-blocking unless @blocked is set, so @src has to stay valid
+	 * until @event has completed. a pitch of 0 means tightly packed
+	 */
+	cl_int
+	write (const cl_command_queue q, const void *src,
+			const EventList &wait = EventList(), Event *event = NULL,
+			const size_t *origin = NULL, const size_t *region = NULL,
+			size_t row_pitch = 0, size_t slice_pitch = 0,
+			cl_bool blocked = false)
+	{
+		size_t o[3], r[3];
+		box(origin, region, o, r);
+		return clEnqueueWriteImage(q, this->cl_obj, blocked, o, r,
+				row_pitch, slice_pitch, src, wait.size(),
+				wait.data(), Event::slot(event));
+	}
+
+
+	cl_int
+	write (const CommandQueue &q, const void *src,
+			const EventList &wait = EventList(), Event *event = NULL,
+			const size_t *origin = NULL, const size_t *region = NULL,
+			size_t row_pitch = 0, size_t slice_pitch = 0,
+			cl_bool blocked = false)
+	{
+		return write(q(), src, wait, event, origin, region, row_pitch,
+				slice_pitch, blocked);
+	}
+
+
+	/**
+	 * read the pixels of @region at @origin into host memory. the read is
+	 * non-blocking unless @blocked is set
+	 */
+	cl_int
+	read (const cl_command_queue q, void *dst,
+			const EventList &wait = EventList(), Event *event = NULL,
+			const size_t *origin = NULL, const size_t *region = NULL,
+			size_t row_pitch = 0, size_t slice_pitch = 0,
+			cl_bool blocked = false)
+	{
+		size_t o[3], r[3];
+		box(origin, region, o, r);
+		return clEnqueueReadImage(q, this->cl_obj, blocked, o, r,
+				row_pitch, slice_pitch, dst, wait.size(),
+				wait.data(), Event::slot(event));
+	}
+
+
+	cl_int
+	read (const CommandQueue &q, void *dst,
+			const EventList &wait = EventList(), Event *event = NULL,
+			const size_t *origin = NULL, const size_t *region = NULL,
+			size_t row_pitch = 0, size_t slice_pitch = 0,
+			cl_bool blocked = false)
+	{
+		return read(q(), dst, wait, event, origin, region, row_pitch,
+				slice_pitch, blocked);
+	}
+
+
+	/**
+	 * map the image after all events in @wait have finished. the pitches
+	 * of the mapping are stored in row_pitch and slice_pitch. the mapping
+	 * is non-blocking by default, so the returned pointer may only be
+	 * accessed after @event has completed
+	 */
+	void*
+	map (const cl_command_queue q, const EventList &wait, Event *event,
+			cl_int *err = NULL,
+			cl_map_flags flags = CL_MAP_READ | CL_MAP_WRITE,
+			cl_bool blocked = false, const size_t *origin = NULL,
+			const size_t *region = NULL)
+	{
+		cl_int e;
+		size_t o[3], r[3];
+		box(origin, region, o, r);
+		slice_pitch = 0;
+		ptr = clEnqueueMapImage(q, this->cl_obj, blocked, flags, o, r,
+				&row_pitch, &slice_pitch, wait.size(),
+				wait.data(), Event::slot(event), &e);
+		if (err)
+			*err = e;
+		return ptr;
+	}
+
+
+	void*
+	map (const CommandQueue &q, const EventList &wait, Event *event,
+			cl_int *err = NULL,
+			cl_map_flags flags = CL_MAP_READ | CL_MAP_WRITE,
+			cl_bool blocked = false, const size_t *origin = NULL,
+			const size_t *region = NULL)
+	{
+		return map(q(), wait, event, err, flags, blocked, origin,
+				region);
+	}
+
+
+	/**
+	 * map the whole image and wait for the mapping
+	 */
+	void*
+	map (const cl_command_queue q, cl_int *err = NULL,
+			cl_map_flags flags = CL_MAP_READ | CL_MAP_WRITE)
+	{
+		return map(q, EventList(), NULL, err, flags, CL_TRUE);
+	}
+
+
+	void*
+	map (const CommandQueue &q, cl_int *err = NULL,
+			cl_map_flags flags = CL_MAP_READ | CL_MAP_WRITE)
+	{
+		return map(q(), err, flags);
+	}
+
+
+	cl_int
+	unmap (const cl_command_queue q, const EventList &wait = EventList(),
+			Event *event = NULL)
+	{
+		cl_int err = clEnqueueUnmapMemObject(q, this->cl_obj, ptr,
+				wait.size(), wait.data(), Event::slot(event));
+		ptr = NULL;
+		return err;
+	}
+
+
+	cl_int
+	unmap (const CommandQueue &q, const EventList &wait = EventList(),
+			Event *event = NULL)
+	{
+		return unmap(q(), wait, event);
+	}
+
+
+	/**
+	 * copy @region from @src_origin of this image to @dst_origin of @dst.
+	 * both images need the same format
+	 */
+	template <unsigned D>
+	cl_int
+	copy_to (const cl_command_queue q, Image<D> &dst,
+			const EventList &wait = EventList(), Event *event = NULL,
+			const size_t *src_origin = NULL,
+			const size_t *dst_origin = NULL,
+			const size_t *region = NULL)
+	{
+		size_t so[3], d[3], r[3];
+		box(src_origin, region, so, r);
+		for (int i = 0; i < 3; i++)
+			d[i] = dst_origin ? dst_origin[i] : 0;
+		if (D == 2)
+			d[2] = 0;
+		return clEnqueueCopyImage(q, this->cl_obj, dst(), so, d, r,
+				wait.size(), wait.data(), Event::slot(event));
+	}
+
+
+	template <unsigned D>
+	cl_int
+	copy_to (const CommandQueue &q, Image<D> &dst,
+			const EventList &wait = EventList(), Event *event = NULL,
+			const size_t *src_origin = NULL,
+			const size_t *dst_origin = NULL,
+			const size_t *region = NULL)
+	{
+		return copy_to(q(), dst, wait, event, src_origin, dst_origin,
+				region);
+	}
+
+
+	/**
+	 * upload tightly packed 8 bit RGB pixels (e.g. the pixels of a PPM
+	 * file) into the whole image. images in CL_RGB are written directly,
+	 * CL_RGBA images are filled through a mapping with an opaque alpha
+	 * channel. returns when the upload has been enqueued, @rgb may be
+	 * reused after that
+	 */
+	cl_int
+	write_rgb (const cl_command_queue q, const unsigned char *rgb,
+			const EventList &wait = EventList(), Event *event = NULL)
+	{
+		if (format.image_channel_order == CL_RGB && pixel_size() == 3)
+			return write(q, rgb, wait, event, NULL, NULL, 0, 0,
+					CL_TRUE);
+		if (format.image_channel_order != CL_RGBA || pixel_size() != 4)
+			return CL_IMAGE_FORMAT_MISMATCH;
+
+		cl_int err;
+		unsigned char *p = (unsigned char*)map(q, wait, NULL, &err,
+				CL_MAP_WRITE, CL_TRUE);
+		if (err != CL_SUCCESS)
+			return err;
+
+		for (size_t z = 0; z < depth; z++)
+			for (size_t y = 0; y < height; y++) {
+				unsigned char *row = p + z * slice_pitch
+					+ y * row_pitch;
+				for (size_t x = 0; x < width; x++) {
+					row[4 * x] = rgb[0];
+					row[4 * x + 1] = rgb[1];
+					row[4 * x + 2] = rgb[2];
+					row[4 * x + 3] = 255;
+					rgb += 3;
+				}
+			}
+		return unmap(q, EventList(), event);
+	}
+
+
+	cl_int
+	write_rgb (const CommandQueue &q, const unsigned char *rgb,
+			const EventList &wait = EventList(), Event *event = NULL)
+	{
+		return write_rgb(q(), rgb, wait, event);
+	}
+
+
+	/**
+	 * download the whole image as tightly packed 8 bit RGB pixels, the
+	 * alpha channel of CL_RGBA images is dropped. blocks until @rgb holds
+	 * the pixels
+	 */
+	cl_int
+	read_rgb (const cl_command_queue q, unsigned char *rgb,
+			const EventList &wait = EventList())
+	{
+		if (format.image_channel_order == CL_RGB && pixel_size() == 3)
+			return read(q, rgb, wait, NULL, NULL, NULL, 0, 0,
+					CL_TRUE);
+		if (format.image_channel_order != CL_RGBA || pixel_size() != 4)
+			return CL_IMAGE_FORMAT_MISMATCH;
+
+		cl_int err;
+		const unsigned char *p = (const unsigned char*)map(q, wait,
+				NULL, &err, CL_MAP_READ, CL_TRUE);
+		if (err != CL_SUCCESS)
+			return err;
+
+		for (size_t z = 0; z < depth; z++)
+			for (size_t y = 0; y < height; y++) {
+				const unsigned char *row = p + z * slice_pitch
+					+ y * row_pitch;
+				for (size_t x = 0; x < width; x++) {
+					rgb[0] = row[4 * x];
+					rgb[1] = row[4 * x + 1];
+					rgb[2] = row[4 * x + 2];
+					rgb += 3;
+				}
+			}
+		return unmap(q);
+	}
+
+
+	cl_int
+	read_rgb (const CommandQueue &q, unsigned char *rgb,
+			const EventList &wait = EventList())
+	{
+		return read_rgb(q(), rgb, wait);
+	}
+
+
+private:
+	cl_int
+	create_image (const cl_context ctx, size_t width, size_t height,
+			size_t depth, const cl_image_format &format,
+			cl_mem_flags flags, void *host, size_t row_pitch,
+			size_t slice_pitch)
+	{
+		cl_int err;
+		cl_mem mem;
+
+#ifdef CL_VERSION_1_2
+		cl_image_desc desc;
+		memset(&desc, 0, sizeof(desc));
+		desc.image_type = Dim == 2 ? CL_MEM_OBJECT_IMAGE2D
+			: CL_MEM_OBJECT_IMAGE3D;
+		desc.image_width = width;
+		desc.image_height = height;
+		desc.image_depth = depth;
+		desc.image_row_pitch = row_pitch;
+		desc.image_slice_pitch = slice_pitch;
+		mem = clCreateImage(ctx, flags, &format, &desc, host, &err);
+#else
+		if (Dim == 2)
+			mem = clCreateImage2D(ctx, flags, &format, width, height,
+					row_pitch, host, &err);
+		else
+			mem = clCreateImage3D(ctx, flags, &format, width, height,
+					depth, row_pitch, slice_pitch, host,
+					&err);
+#endif
+		if (err != CL_SUCCESS)
+			return err;
+
+		reset(mem);
+		this->width = width;
+		this->height = height;
+		this->depth = depth;
+		this->format = format;
+		return CL_SUCCESS;
+	}
+
+
+	/**
+	 * origin and region for the OpenCL calls, the third dimension of 2D
+	 * images is always 0 and 1
+	 */
+	void
+	box (const size_t *origin, const size_t *region, size_t *o,
+			size_t *r) const
+	{
+		const size_t whole[3] = {width, height, depth};
+		for (int i = 0; i < 3; i++) {
+			o[i] = origin ? origin[i] : 0;
+			r[i] = region ? region[i] : whole[i];
+		}
+		if (Dim == 2) {
+			o[2] = 0;
+			r[2] = 1;
+		}
+	}
+};
+
+
+typedef Image<2> Image2D;
+typedef Image<3> Image3D;
+
+
+inline const void*
+KernelArg<Sampler>::ptr (const Sampler &arg)
+{
+	return &(arg.cl_obj);
+}
+
+
+inline KernelArgCache<Sampler>::type
+KernelArgCache<Sampler>::value (const Sampler &arg)
+{
+	return arg.cl_obj;
+}
+
+
+/*
+ * reduction operators. an operator provides the OpenCL C expression that
+ * combines two values a and b and the identity element for an element type.
+ * custom operators have to provide the same interface, e.g.
+ *
+ *	struct ReduceSumOfSquares {
+ *		template <typename T> static std::string identity () { return "0"; }
+ *		static const char* combine () { return "(a) + (b) * (b)"; }
+ *	};
+ *
+ * note that combine is also used to merge partial results, so it has to be
+ * associative for the result to be meaningful.
+ *
+ * to reduce on the host as well (host_reduce, HybridReduction), an operator
+ * also provides the identity and the operation as host code, host_identity
+ * and apply.
+ */
+struct ReduceSum
+{
+	template <typename T>
+	static std::string identity () { return "0"; }
+
+	static const char* combine () { return "(a) + (b)"; }
+
+	template <typename T>
+	static T host_identity () { return T(0); }
+
+	template <typename T>
+	static T apply (T a, T b) { return a + b; }
+};
+
+
+struct ReduceProduct
+{
+	template <typename T>
+	static std::string identity () { return "1"; }
+
+	static const char* combine () { return "(a) * (b)"; }
+
+	template <typename T>
+	static T host_identity () { return T(1); }
+
+	template <typename T>
+	static T apply (T a, T b) { return a * b; }
+};
+
+
+struct ReduceMin
+{
+	template <typename T>
+	static std::string identity () { return CLTypeName<T>::max(); }
+
+	static const char* combine () { return "((b) < (a) ? (b) : (a))"; }
+
+	template <typename T>
+	static T
+	host_identity ()
+	{
+		return std::numeric_limits<T>::has_infinity
+			? std::numeric_limits<T>::infinity()
+			: std::numeric_limits<T>::max();
+	}
+
+	template <typename T>
+	static T apply (T a, T b) { return b < a ? b : a; }
+};
+
+
+struct ReduceMax
+{
+	template <typename T>
+	static std::string identity () { return CLTypeName<T>::lowest(); }
+
+	static const char* combine () { return "((b) > (a) ? (b) : (a))"; }
+
+	template <typename T>
+	static T
+	host_identity ()
+	{
+		return std::numeric_limits<T>::has_infinity
+			? -std::numeric_limits<T>::infinity()
+			: std::numeric_limits<T>::lowest();
+	}
+
+	template <typename T>
+	static T apply (T a, T b) { return b > a ? b : a; }
+};
+
+
+/**
+ * OpenCL C source of the reduction kernel. each work-item accumulates a
+ * strided range of the input in a register, then the work-group reduces the
+ * register values in local memory and writes one value per work-group. the
+ * local work size has to be a power of two.
+ */
+inline const char*
+reduction_source ()
+{
+	return
+	"__kernel void\n"
+	"reduce (__global const T *src, __global T *dst, const uint n,\n"
+	"		__local T *scratch)\n"
+	"{\n"
+	"	const uint lid = get_local_id(0);\n"
+	"	const uint stride = get_global_size(0);\n"
+	"	T acc = IDENTITY;\n"
+	"	for (uint i = get_global_id(0); i < n; i += stride)\n"
+	"		acc = OP(acc, src[i]);\n"
+	"	scratch[lid] = acc;\n"
+	"	barrier(CLK_LOCAL_MEM_FENCE);\n"
+	"	for (uint s = get_local_size(0) / 2; s > 0; s >>= 1) {\n"
+	"		if (lid < s)\n"
+	"			scratch[lid] = OP(scratch[lid], scratch[lid + s]);\n"
+	"		barrier(CLK_LOCAL_MEM_FENCE);\n"
+	"	}\n"
+	"	if (lid == 0)\n"
+	"		dst[get_group_id(0)] = scratch[0];\n"
+	"}\n";
+}
+
+
+/**
+ * struct Reduction - reduces a buffer to a single value on the device.
+ *
+ * The first pass reduces the input to one partial result per work-group, the
+ * second pass reduces the partial results with a single work-group. Only the
+ * final value is transferred to the host.
+ *
+ * @T:		element type
+ * @Op:		reduction operator (ReduceSum, ReduceMin, ReduceMax,
+ *		ReduceProduct or a custom operator)
+ */
+template <typename T, typename Op = ReduceSum>
+struct Reduction
+{
+	Program program;
+	Kernel kernel;
+
+	//! one partial result per work-group of the first pass
+	Buffer<T> partials;
+
+	//! final result of the second pass
+	Buffer<T> result;
+
+	size_t local_size;
+	size_t max_groups;
+
+
+	Reduction ()
+		: local_size(0)
+		, max_groups(0)
+	{}
+
+
+	Reduction (const Reduction &) = delete;
+	Reduction& operator= (const Reduction &) = delete;
+
+
+	/**
+	 * build the reduction kernel for @device and allocate the buffers for
+	 * intermediate results
+	 */
+	cl_int
+	create (const Context &context, const Device &device,
+			const ProgramCache *cache = NULL)
+	{
+		cl_int err;
+		BuildOptions opts;
+		opts.type<T>("T")
+		    .source(std::string("#define IDENTITY ((T)(")
+				    + Op::template identity<T>() + "))")
+		    .source(std::string("#define OP(a, b) (") + Op::combine()
+				    + ")");
+
+		err = program.build_from_source(context, reduction_source(),
+				opts, cache);
+		if (err != CL_SUCCESS)
+			return err;
+		err = kernel.create(program, "reduce");
+		if (err != CL_SUCCESS)
+			return err;
+
+		// largest power of two the kernel can be launched with, limited
+		// to 256 work-items which is plenty for the tree reduction
+		size_t wg = 0;
+		cl_uint cus = 0;
+		err = clGetKernelWorkGroupInfo(kernel(), device(),
+				CL_KERNEL_WORK_GROUP_SIZE, sizeof(wg), &wg, NULL);
+		if (err == CL_SUCCESS)
+			err = device_info(device(),
+					CL_DEVICE_MAX_COMPUTE_UNITS, &cus);
+		if (err != CL_SUCCESS)
+			return CL_INVALID_DEVICE;
+		for (local_size = 1; local_size * 2 <= wg && local_size < 256;)
+			local_size *= 2;
+
+		// enough work-groups to keep every compute unit busy
+		max_groups = cus * 4;
+		if (max_groups > local_size)
+			max_groups = local_size;
+
+		err = partials.mallocDevice(context, max_groups * sizeof(T));
+		if (err != CL_SUCCESS)
+			return err;
+		return result.mallocDevice(context, sizeof(T));
+	}
+
+
+	/**
+	 * enqueue the reduction of the first @n elements of @src. the result is
+	 * left in the buffer 'result' when @event has completed
+	 */
+	cl_int
+	enqueue (const cl_command_queue q, const Buffer<T> &src, size_t n,
+			const EventList &wait = EventList(), Event *event = NULL)
+	{
+		cl_int err;
+		Event first;
+
+		if (!n || n > 0xffffffffUL)
+			return CL_INVALID_VALUE;
+
+		size_t groups = (n + local_size - 1) / local_size;
+		if (groups > max_groups)
+			groups = max_groups;
+
+		LocalMemory scratch(local_size * sizeof(T));
+		size_t global = groups * local_size;
+		err = kernel.set_args(src, partials, (cl_uint)n, scratch);
+		if (err != CL_SUCCESS)
+			return err;
+		err = kernel.run(q, 1, &global, &local_size, wait, &first);
+		if (err != CL_SUCCESS)
+			return err;
+
+		err = kernel.set_args(partials, result, (cl_uint)groups,
+				scratch);
+		if (err != CL_SUCCESS)
+			return err;
+		return kernel.run(q, 1, &local_size, &local_size,
+				EventList(first), event);
+	}
+
+
+	cl_int
+	enqueue (const CommandQueue &q, const Buffer<T> &src, size_t n,
+			const EventList &wait = EventList(), Event *event = NULL)
+	{
+		return enqueue(q(), src, n, wait, event);
+	}
+
+
+	/**
+	 * reduce the first @n elements of @src and block until the value is
+	 * available in @value
+	 */
+	cl_int
+	run (const cl_command_queue q, const Buffer<T> &src, size_t n,
+			T *value, const EventList &wait = EventList())
+	{
+		Event done;
+		cl_int err = enqueue(q, src, n, wait, &done);
+		if (err != CL_SUCCESS)
+			return err;
+		return result.read(q, value, EventList(done), NULL, sizeof(T), 0,
+				CL_TRUE);
+	}
+
+
+	cl_int
+	run (const CommandQueue &q, const Buffer<T> &src, size_t n, T *value,
+			const EventList &wait = EventList())
+	{
+		return run(q(), src, n, value, wait);
+	}
+};
+
+
+/*
+ * host execution of the standard primitives. for small problems the host is
+ * faster than a round trip to the device, see Crossover. float versions use
+ * SSE2, and AVX2 with FMA when the CPU supports it (selected at run time, so
+ * the code builds with -msse2 only). define CL0X_NO_SIMD to use the scalar
+ * versions only.
+ */
+
+#if !defined(CL0X_NO_SIMD) && defined(__SSE2__)
+#define CL0X_HOST_SSE2 1
+#if (defined(__GNUC__) || defined(__clang__)) \
+    && (defined(__x86_64__) || defined(__i386__))
+#define CL0X_HOST_AVX2 1
+#endif
+#endif
+
+
+enum HostSimd {
+	HOST_SCALAR = 0,
+	HOST_SSE2,
+	HOST_AVX2
+};
+
+
+/**
+ * the widest instruction set the host code uses on this CPU
+ */
+inline HostSimd
+host_simd ()
+{
+#if defined(CL0X_HOST_AVX2)
+	static const HostSimd level = __builtin_cpu_supports("avx2")
+		&& __builtin_cpu_supports("fma") ? HOST_AVX2 : HOST_SSE2;
+	return level;
+#elif defined(CL0X_HOST_SSE2)
+	return HOST_SSE2;
+#else
+	return HOST_SCALAR;
+#endif
+}
+
+
+namespace simd {
+
+#if defined(CL0X_HOST_SSE2)
+inline float
+hsum (__m128 v)
+{
+	v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+	v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+	return _mm_cvtss_f32(v);
+}
+
+
+inline float
+dot_sse2 (const float *a, const float *b, size_t n)
+{
+	__m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+	__m128 s2 = _mm_setzero_ps(), s3 = _mm_setzero_ps();
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(a + i),
+					_mm_loadu_ps(b + i)));
+		s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(a + i + 4),
+					_mm_loadu_ps(b + i + 4)));
+		s2 = _mm_add_ps(s2, _mm_mul_ps(_mm_loadu_ps(a + i + 8),
+					_mm_loadu_ps(b + i + 8)));
+		s3 = _mm_add_ps(s3, _mm_mul_ps(_mm_loadu_ps(a + i + 12),
+					_mm_loadu_ps(b + i + 12)));
+	}
+	for (; i + 4 <= n; i += 4)
+		s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(a + i),
+					_mm_loadu_ps(b + i)));
+	float s = hsum(_mm_add_ps(_mm_add_ps(s0, s1), _mm_add_ps(s2, s3)));
+	for (; i < n; i++)
+		s += a[i] * b[i];
+	return s;
+}
+
+
+/**
+ * reduce with the operation selected by @kind (0: sum, 1: min, 2: max) on
+ * four accumulators starting at @init, the identity of the operation. the
+ * number of elements consumed is stored in @done
+ */
+inline __m128
+reduce_sse2 (int kind, const float *src, size_t n, float init, size_t *done)
+{
+	__m128 s0 = _mm_set1_ps(init), s1 = s0, s2 = s0, s3 = s0;
+	size_t i = 0;
+
+#define CL0X_REDUCE_SSE2(OP)						\
+	for (; i + 16 <= n; i += 16) {					\
+		s0 = OP(s0, _mm_loadu_ps(src + i));			\
+		s1 = OP(s1, _mm_loadu_ps(src + i + 4));			\
+		s2 = OP(s2, _mm_loadu_ps(src + i + 8));			\
+		s3 = OP(s3, _mm_loadu_ps(src + i + 12));		\
+	}								\
+	for (; i + 4 <= n; i += 4)					\
+		s0 = OP(s0, _mm_loadu_ps(src + i));			\
+	s0 = OP(OP(s0, s1), OP(s2, s3));
+
+	if (kind == 0) {
+		CL0X_REDUCE_SSE2(_mm_add_ps)
+	} else if (kind == 1) {
+		CL0X_REDUCE_SSE2(_mm_min_ps)
+	} else {
+		CL0X_REDUCE_SSE2(_mm_max_ps)
+	}
+#undef CL0X_REDUCE_SSE2
+
+	*done = i;
+	return s0;
+}
+
+
+inline void
+axpy_sse2 (float alpha, const float *x, float *y, size_t n)
+{
+	const __m128 a = _mm_set1_ps(alpha);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128 y0 = _mm_add_ps(_mm_loadu_ps(y + i),
+				_mm_mul_ps(a, _mm_loadu_ps(x + i)));
+		__m128 y1 = _mm_add_ps(_mm_loadu_ps(y + i + 4),
+				_mm_mul_ps(a, _mm_loadu_ps(x + i + 4)));
+		_mm_storeu_ps(y + i, y0);
+		_mm_storeu_ps(y + i + 4, y1);
+	}
+	for (; i < n; i++)
+		y[i] += alpha * x[i];
+}
+#endif
+
+
+#if defined(CL0X_HOST_AVX2)
+__attribute__((target("avx2,fma"))) inline float
+dot_avx2 (const float *a, const float *b, size_t n)
+{
+	__m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+	__m256 s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i),
+				_mm256_loadu_ps(b + i), s0);
+		s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8),
+				_mm256_loadu_ps(b + i + 8), s1);
+		s2 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 16),
+				_mm256_loadu_ps(b + i + 16), s2);
+		s3 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 24),
+				_mm256_loadu_ps(b + i + 24), s3);
+	}
+	for (; i + 8 <= n; i += 8)
+		s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i),
+				_mm256_loadu_ps(b + i), s0);
+	__m256 s = _mm256_add_ps(_mm256_add_ps(s0, s1), _mm256_add_ps(s2, s3));
+	__m128 h = _mm_add_ps(_mm256_castps256_ps128(s),
+			_mm256_extractf128_ps(s, 1));
+	h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+	h = _mm_add_ss(h, _mm_shuffle_ps(h, h, 1));
+	float r = _mm_cvtss_f32(h);
+	for (; i < n; i++)
+		r += a[i] * b[i];
+	return r;
+}
+
+
+/**
+ * AVX2 version of reduce_sse2, the accumulators are folded into one SSE
+ * register
+ */
+__attribute__((target("avx2,fma"))) inline __m128
+reduce_avx2 (int kind, const float *src, size_t n, float init, size_t *done)
+{
+	__m256 s0 = _mm256_set1_ps(init), s1 = s0, s2 = s0, s3 = s0;
+	size_t i = 0;
+
+#define CL0X_REDUCE_AVX2(OP)						\
+	for (; i + 32 <= n; i += 32) {					\
+		s0 = OP(s0, _mm256_loadu_ps(src + i));			\
+		s1 = OP(s1, _mm256_loadu_ps(src + i + 8));		\
+		s2 = OP(s2, _mm256_loadu_ps(src + i + 16));		\
+		s3 = OP(s3, _mm256_loadu_ps(src + i + 24));		\
+	}								\
+	for (; i + 8 <= n; i += 8)					\
+		s0 = OP(s0, _mm256_loadu_ps(src + i));			\
+	s0 = OP(OP(s0, s1), OP(s2, s3));
+
+	__m128 r;
+	if (kind == 0) {
+		CL0X_REDUCE_AVX2(_mm256_add_ps)
+		r = _mm_add_ps(_mm256_castps256_ps128(s0),
+				_mm256_extractf128_ps(s0, 1));
+	} else if (kind == 1) {
+		CL0X_REDUCE_AVX2(_mm256_min_ps)
+		r = _mm_min_ps(_mm256_castps256_ps128(s0),
+				_mm256_extractf128_ps(s0, 1));
+	} else {
+		CL0X_REDUCE_AVX2(_mm256_max_ps)
+		r = _mm_max_ps(_mm256_castps256_ps128(s0),
+				_mm256_extractf128_ps(s0, 1));
+	}
+#undef CL0X_REDUCE_AVX2
+
+	*done = i;
+	return r;
+}
+
+
+__attribute__((target("avx2,fma"))) inline void
+axpy_avx2 (float alpha, const float *x, float *y, size_t n)
+{
+	const __m256 a = _mm256_set1_ps(alpha);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m256 y0 = _mm256_fmadd_ps(a, _mm256_loadu_ps(x + i),
+				_mm256_loadu_ps(y + i));
+		__m256 y1 = _mm256_fmadd_ps(a, _mm256_loadu_ps(x + i + 8),
+				_mm256_loadu_ps(y + i + 8));
+		_mm256_storeu_ps(y + i, y0);
+		_mm256_storeu_ps(y + i + 8, y1);
+	}
+	for (; i < n; i++)
+		y[i] += alpha * x[i];
+}
+#endif
+
+/*
+ * conversion between 8 bit unsigned normalized values and floats. floats are
+ * scaled by 255, clamped to [0, 255] (NaN gives 0) and truncated, the vector
+ * code clamps before the conversion so every lane matches the scalar tail
+ */
+inline float
+unorm8_to_float_1 (unsigned char v, float scale)
+{
+	float f = v * scale;
+	return f > 1.0f ? 1.0f : f;
+}
+
+
+inline unsigned char
+float_to_unorm8_1 (float v)
+{
+	v *= 255.0f;
+	if (!(v > 0.0f))
+		return 0;
+	return v >= 255.0f ? 255 : (unsigned char)v;
+}
+
+
+#if defined(CL0X_HOST_SSE2)
+inline void
+unorm8_to_float_sse2 (const unsigned char *src, float *dst, size_t n,
+		float scale)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 s = _mm_set1_ps(scale), one = _mm_set1_ps(1.0f);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + i));
+		__m128i lo = _mm_unpacklo_epi8(b, zero);
+		__m128i hi = _mm_unpackhi_epi8(b, zero);
+		__m128 f0 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero));
+		__m128 f1 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero));
+		__m128 f2 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero));
+		__m128 f3 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero));
+		_mm_storeu_ps(dst + i, _mm_min_ps(_mm_mul_ps(f0, s), one));
+		_mm_storeu_ps(dst + i + 4, _mm_min_ps(_mm_mul_ps(f1, s), one));
+		_mm_storeu_ps(dst + i + 8, _mm_min_ps(_mm_mul_ps(f2, s), one));
+		_mm_storeu_ps(dst + i + 12, _mm_min_ps(_mm_mul_ps(f3, s), one));
+	}
+	for (; i < n; i++)
+		dst[i] = unorm8_to_float_1(src[i], scale);
+}
+
+
+// max returns its second operand for NaN, so NaN ends up as 0
+inline __m128i
+float_to_unorm8_sse2_4 (const float *src)
+{
+	const __m128 m = _mm_set1_ps(255.0f);
+	__m128 v = _mm_mul_ps(_mm_loadu_ps(src), m);
+	v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), m);
+	return _mm_cvttps_epi32(v);
+}
+
+
+inline void
+float_to_unorm8_sse2 (const float *src, unsigned char *dst, size_t n)
+{
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i i0 = float_to_unorm8_sse2_4(src + i);
+		__m128i i1 = float_to_unorm8_sse2_4(src + i + 4);
+		__m128i i2 = float_to_unorm8_sse2_4(src + i + 8);
+		__m128i i3 = float_to_unorm8_sse2_4(src + i + 12);
+		__m128i w0 = _mm_packs_epi32(i0, i1);
+		__m128i w1 = _mm_packs_epi32(i2, i3);
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(w0, w1));
+	}
+	for (; i < n; i++)
+		dst[i] = float_to_unorm8_1(src[i]);
+}
+#endif
+
+
+#if defined(CL0X_HOST_AVX2)
+__attribute__((target("avx2,fma"))) inline void
+unorm8_to_float_avx2 (const unsigned char *src, float *dst, size_t n,
+		float scale)
+{
+	const __m256 s = _mm256_set1_ps(scale), one = _mm256_set1_ps(1.0f);
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32)
+		for (size_t k = 0; k < 32; k += 8) {
+			__m128i b = _mm_loadl_epi64(
+					(const __m128i*)(src + i + k));
+			__m256 f = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(b));
+			_mm256_storeu_ps(dst + i + k,
+					_mm256_min_ps(_mm256_mul_ps(f, s), one));
+		}
+	for (; i < n; i++)
+		dst[i] = unorm8_to_float_1(src[i], scale);
+}
+
+
+__attribute__((target("avx2,fma"))) inline __m256i
+float_to_unorm8_avx2_8 (const float *src)
+{
+	const __m256 m = _mm256_set1_ps(255.0f);
+	__m256 v = _mm256_mul_ps(_mm256_loadu_ps(src), m);
+	v = _mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()), m);
+	return _mm256_cvttps_epi32(v);
+}
+
+
+__attribute__((target("avx2,fma"))) inline void
+float_to_unorm8_avx2 (const float *src, unsigned char *dst, size_t n)
+{
+	// the packs work within 128 bit lanes, this restores the order
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i i0 = float_to_unorm8_avx2_8(src + i);
+		__m256i i1 = float_to_unorm8_avx2_8(src + i + 8);
+		__m256i i2 = float_to_unorm8_avx2_8(src + i + 16);
+		__m256i i3 = float_to_unorm8_avx2_8(src + i + 24);
+		__m256i b = _mm256_packus_epi16(_mm256_packs_epi32(i0, i1),
+				_mm256_packs_epi32(i2, i3));
+		_mm256_storeu_si256((__m256i*)(dst + i),
+				_mm256_permutevar8x32_epi32(b, order));
+	}
+	for (; i < n; i++)
+		dst[i] = float_to_unorm8_1(src[i]);
+}
+#endif
+
+} // namespace simd
+
+
+/**
+ * dot product of @a and @b with @n elements
+ */
+template <typename T>
+inline T
+host_dot (const T *a, const T *b, size_t n)
+{
+	T s = T(0);
+	for (size_t i = 0; i < n; i++)
+		s += a[i] * b[i];
+	return s;
+}
+
+
+template <>
+inline float
+host_dot<float> (const float *a, const float *b, size_t n)
+{
+#if defined(CL0X_HOST_AVX2)
+	if (host_simd() == HOST_AVX2)
+		return simd::dot_avx2(a, b, n);
+#endif
+#if defined(CL0X_HOST_SSE2)
+	return simd::dot_sse2(a, b, n);
+#else
+	float s = 0.0f;
+	for (size_t i = 0; i < n; i++)
+		s += a[i] * b[i];
+	return s;
+#endif
+}
+
+
+/**
+ * y = alpha * x + y for @n elements
+ */
+template <typename T>
+inline void
+host_axpy (T alpha, const T *x, T *y, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		y[i] += alpha * x[i];
+}
+
+
+template <>
+inline void
+host_axpy<float> (float alpha, const float *x, float *y, size_t n)
+{
+#if defined(CL0X_HOST_AVX2)
+	if (host_simd() == HOST_AVX2) {
+		simd::axpy_avx2(alpha, x, y, n);
+		return;
+	}
+#endif
+#if defined(CL0X_HOST_SSE2)
+	simd::axpy_sse2(alpha, x, y, n);
+#else
+	for (size_t i = 0; i < n; i++)
+		y[i] += alpha * x[i];
+#endif
+}
+
+
+/**
+ * struct HostReduce - reduction of host memory with a reduction operator.
+ * specialized for float sums, minima and maxima
+ */
+template <typename T, typename Op>
+struct HostReduce
+{
+	static T
+	run (const T *src, size_t n)
+	{
+		T acc = Op::template host_identity<T>();
+		for (size_t i = 0; i < n; i++)
+			acc = Op::apply(acc, src[i]);
+		return acc;
+	}
+};
+
+
+#if defined(CL0X_HOST_SSE2)
+template <typename Op, int kind>
+struct HostReduceSimd
+{
+	static float
+	run (const float *src, size_t n)
+	{
+		const float init = Op::template host_identity<float>();
+		size_t i = 0;
+		__m128 v;
+#if defined(CL0X_HOST_AVX2)
+		if (host_simd() == HOST_AVX2)
+			v = simd::reduce_avx2(kind, src, n, init, &i);
+		else
+#endif
+			v = simd::reduce_sse2(kind, src, n, init, &i);
+
+		float lanes[4];
+		_mm_storeu_ps(lanes, v);
+		float acc = Op::apply(Op::apply(lanes[0], lanes[1]),
+				Op::apply(lanes[2], lanes[3]));
+		for (; i < n; i++)
+			acc = Op::apply(acc, src[i]);
+		return acc;
+	}
+};
+
+
+template <>
+struct HostReduce <float, ReduceSum>
+	: HostReduceSimd<ReduceSum, 0> {};
+
+template <>
+struct HostReduce <float, ReduceMin>
+	: HostReduceSimd<ReduceMin, 1> {};
+
+template <>
+struct HostReduce <float, ReduceMax>
+	: HostReduceSimd<ReduceMax, 2> {};
+#endif
+
+
+template <typename T, typename Op>
+inline T
+host_reduce (const T *src, size_t n)
+{
+	return HostReduce<T, Op>::run(src, n);
+}
+
+
+/**
+ * run @fn on contiguous ranges [begin, end) that cover [0, @n) on @nthreads
+ * threads (one per hardware thread if 0). the ranges are multiples of
+ * @grain elements except for the last one, the calling thread processes the
+ * first range. returns when all ranges are done
+ */
+inline void
+host_parallel_for (size_t n, std::function<void (size_t, size_t)> fn,
+		unsigned nthreads = 0, size_t grain = 1 << 16)
+{
+	if (!nthreads)
+		nthreads = std::thread::hardware_concurrency();
+	if (!grain)
+		grain = 1;
+	size_t chunks = (n + grain - 1) / grain;
+	if (nthreads > chunks)
+		nthreads = (unsigned)chunks;
+	if (nthreads <= 1) {
+		if (n)
+			fn(0, n);
+		return;
+	}
+
+	const size_t per = (chunks + nthreads - 1) / nthreads * grain;
+	std::vector<std::thread> threads;
+	for (size_t begin = per; begin < n; begin += per) {
+		size_t end = std::min(n, begin + per);
+		try {
+			threads.push_back(std::thread(fn, begin, end));
+		} catch (const std::system_error &) {
+			fn(begin, end);
+		}
+	}
+	fn(0, std::min(n, per));
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+}
+
+
+/**
+ * convert @n 8 bit values to floats, dst = min(src * @scale, 1). pass
+ * 1 / maxval as @scale to normalize values with a maximum of maxval. the
+ * work is split over @nthreads threads, 0 uses all hardware threads
+ */
+inline void
+host_unorm8_to_float (const unsigned char *src, float *dst, size_t n,
+		float scale = 1.0f / 255.0f, unsigned nthreads = 1)
+{
+	host_parallel_for(n, [=](size_t begin, size_t end) {
+		const unsigned char *s = src + begin;
+		float *d = dst + begin;
+		size_t len = end - begin;
+#if defined(CL0X_HOST_AVX2)
+		if (host_simd() == HOST_AVX2) {
+			simd::unorm8_to_float_avx2(s, d, len, scale);
+			return;
+		}
+#endif
+#if defined(CL0X_HOST_SSE2)
+		simd::unorm8_to_float_sse2(s, d, len, scale);
+#else
+		for (size_t i = 0; i < len; i++)
+			d[i] = simd::unorm8_to_float_1(s[i], scale);
+#endif
+	}, nthreads);
+}
+
+
+/**
+ * convert @n floats in [0, 1] to 8 bit values, dst = src * 255 truncated
+ * and saturated. the work is split over @nthreads threads, 0 uses all
+ * hardware threads
+ */
+inline void
+host_float_to_unorm8 (const float *src, unsigned char *dst, size_t n,
+		unsigned nthreads = 1)
+{
+	host_parallel_for(n, [=](size_t begin, size_t end) {
+		const float *s = src + begin;
+		unsigned char *d = dst + begin;
+		size_t len = end - begin;
+#if defined(CL0X_HOST_AVX2)
+		if (host_simd() == HOST_AVX2) {
+			simd::float_to_unorm8_avx2(s, d, len);
+			return;
+		}
+#endif
+#if defined(CL0X_HOST_SSE2)
+		simd::float_to_unorm8_sse2(s, d, len);
+#else
+		for (size_t i = 0; i < len; i++)
+			d[i] = simd::float_to_unorm8_1(s[i]);
+#endif
+	}, nthreads);
+}
+
+
+/**
+ * struct Crossover - problem size from which on the device is faster than
+ * the host, including all transfers.
+ *
+ * The default is taken from $CL0X_CROSSOVER or 65536 elements. calibrate()
+ * measures both paths on the target machine instead.
+ *
+ * @size:	problem sizes below this size run on the host
+ */
+struct Crossover
+{
+	size_t size;
+
+
+	explicit
+	Crossover (size_t size = 0)
+		: size(size ? size : default_size())
+	{}
+
+
+	static size_t
+	default_size ()
+	{
+		const char *s = getenv("CL0X_CROSSOVER");
+		size_t n = s ? strtoul(s, NULL, 0) : 0;
+		return n ? n : 65536;
+	}
+
+
+	bool
+	use_host (size_t n) const
+	{
+		return n < size;
+	}
+
+
+	/**
+	 * time @host and @device for doubling problem sizes from @min to @max
+	 * and set the crossover to the first size at which the device wins.
+	 * both functions have to block until their result is available. each
+	 * size is measured @reps times and the fastest run counts
+	 */
+	cl_int
+	calibrate (std::function<cl_int (size_t)> host,
+			std::function<cl_int (size_t)> device,
+			size_t min = 1024, size_t max = 1 << 24, int reps = 3)
+	{
+		typedef std::chrono::steady_clock clock;
+
+		// warm up, the first device run includes lazy initialization
+		cl_int err = device(min);
+		if (err != CL_SUCCESS)
+			return err;
+
+		for (size_t n = min; n <= max; n *= 2) {
+			double th = 0.0, td = 0.0;
+			for (int r = 0; r < reps; r++) {
+				clock::time_point t0 = clock::now();
+				err = host(n);
+				clock::time_point t1 = clock::now();
+				if (err != CL_SUCCESS)
+					return err;
+				err = device(n);
+				clock::time_point t2 = clock::now();
+				if (err != CL_SUCCESS)
+					return err;
+
+				double h = std::chrono::duration<double>(
+						t1 - t0).count();
+				double d = std::chrono::duration<double>(
+						t2 - t1).count();
+				th = r ? std::min(th, h) : h;
+				td = r ? std::min(td, d) : d;
+			}
+			if (td < th) {
+				size = n;
+				return CL_SUCCESS;
+			}
+		}
+
+		// the device never won
+		size = max * 2;
+		return CL_SUCCESS;
+	}
+};
+
+
+/**
+ * struct HybridReduction - reduces host memory either on the host or on the
+ * device, depending on the problem size.
+ *
+ * Small inputs are reduced by host_reduce, large inputs are uploaded to a
+ * staging buffer and reduced by a Reduction. The operator has to provide the
+ * host interface (host_identity and apply) in addition to the OpenCL C
+ * expressions.
+ */
+template <typename T, typename Op = ReduceSum>
+struct HybridReduction
+{
+	Reduction<T, Op> device;
+	Crossover crossover;
+	Buffer<T> staging;
+	cl_context ctx;
+
+
+	HybridReduction ()
+		: ctx(NULL)
+	{}
+
+
+	HybridReduction (const HybridReduction &) = delete;
+	HybridReduction& operator= (const HybridReduction &) = delete;
+
+
+	cl_int
+	create (const Context &context, const Device &dev,
+			const ProgramCache *cache = NULL)
+	{
+		ctx = context();
+		return device.create(context, dev, cache);
+	}
+
+
+	/**
+	 * reduce the @n elements at @src and store the result in @value
+	 */
+	cl_int
+	run (const cl_command_queue q, const T *src, size_t n, T *value)
+	{
+		if (crossover.use_host(n)) {
+			*value = host_reduce<T, Op>(src, n);
+			return CL_SUCCESS;
+		}
+
+		cl_int err;
+		if (staging.size < n * sizeof(T)) {
+			staging.reset();
+			err = staging.mallocDevice(ctx, n * sizeof(T),
+					CL_MEM_READ_ONLY);
+			if (err != CL_SUCCESS) {
+				staging.size = 0;
+				return err;
+			}
+		}
+
+		Event uploaded;
+		err = staging.write(q, src, EventList(), &uploaded,
+				n * sizeof(T));
+		if (err != CL_SUCCESS)
+			return err;
+		return device.run(q, staging, n, value, EventList(uploaded));
+	}
+
+
+	cl_int
+	run (const CommandQueue &q, const T *src, size_t n, T *value)
+	{
+		return run(q(), src, n, value);
+	}
+
+
+	/**
+	 * measure the crossover between host and device on @q for sizes up to
+	 * @max elements
+	 */
+	cl_int
+	calibrate (const cl_command_queue q, size_t max = 1 << 24)
+	{
+		std::vector<T> data(max, T(1));
+		const size_t old = crossover.size;
+		Crossover measured;
+		T v;
+
+		// run() takes the device path while the crossover is zero
+		crossover.size = 0;
+		cl_int err = measured.calibrate(
+			[&](size_t n) {
+				v = host_reduce<T, Op>(&data[0], n);
+				return (cl_int)CL_SUCCESS;
+			},
+			[&](size_t n) {
+				return run(q, &data[0], n, &v);
+			}, 1024, max);
+		crossover.size = err == CL_SUCCESS ? measured.size : old;
+		return err;
+	}
+};
+
+
+/**
+ * struct BufferPoolStats - counters of a BufferPool
+ *
+ * @requests:	number of allocations
+ * @hits:	allocations served from a previously released buffer
+ * @requested:	bytes requested by the live allocations
+ * @reserved:	bytes of the size classes of the live allocations
+ * @idle:	bytes held in the free lists
+ * @slabs:	bytes allocated for slabs
+ */
+struct BufferPoolStats
+{
+	size_t requests;
+	size_t hits;
+	size_t requested;
+	size_t reserved;
+	size_t idle;
+	size_t slabs;
+
+
+	BufferPoolStats ()
+		: requests(0), hits(0), requested(0), reserved(0), idle(0)
+		, slabs(0)
+	{}
+
+
+	double
+	hit_rate () const
+	{
+		return requests ? (double)hits / requests : 0.0;
+	}
+
+
+	/**
+	 * fraction of the reserved bytes that is lost to size class rounding
+	 */
+	double
+	fragmentation () const
+	{
+		return reserved ? 1.0 - (double)requested / reserved : 0.0;
+	}
+};
+
+
+/**
+ * struct BufferPool - recycles memory objects of one context.
+ *
+ * Allocations are rounded up to power-of-two size classes. Released buffers
+ * are kept in a free list per size class and handed out again instead of
+ * calling clCreateBuffer. Size classes up to @small_limit are carved out of
+ * slabs of @slab_size bytes with clCreateSubBuffer, with every sub-buffer
+ * aligned to CL_DEVICE_MEM_BASE_ADDR_ALIGN of the devices in the context.
+ *
+ * The pool owns all memory objects, buffers handed out by allocate() have to
+ * be given back by release() and must not outlive the pool. All functions
+ * are thread-safe.
+ */
+struct BufferPool
+{
+	struct Slab
+	{
+		cl_mem mem;
+		size_t size;
+		size_t next;
+	};
+
+
+	cl_context ctx;
+	cl_mem_flags flags;
+	size_t min_class;
+	size_t small_limit;
+	size_t slab_size;
+	size_t align;
+
+	std::mutex lock;
+	std::map<size_t, std::vector<cl_mem>> free_lists;
+
+	//! size class and requested size of every live allocation
+	std::map<cl_mem, std::pair<size_t, size_t>> live;
+
+	//! slab currently carved up for each small size class
+	std::map<size_t, Slab> current;
+
+	std::vector<cl_mem> slabs;
+	std::set<cl_mem> sub_buffers;
+	BufferPoolStats counters;
+
+
+	BufferPool (size_t small_limit = 64 * 1024,
+			size_t slab_size = 4 * 1024 * 1024,
+			size_t min_class = 256)
+		: ctx(NULL)
+		, flags(CL_MEM_READ_WRITE)
+		, min_class(min_class)
+		, small_limit(small_limit)
+		, slab_size(slab_size)
+		, align(1)
+	{}
+
+
+	BufferPool (const BufferPool &) = delete;
+	BufferPool& operator= (const BufferPool &) = delete;
+
+
+	~BufferPool ()
+	{
+		clear();
+	}
+
+
+	/**
+	 * set up the pool for a context. @flags are used for all buffers
+	 */
+	cl_int
+	create (const cl_context ctx, cl_mem_flags flags = CL_MEM_READ_WRITE)
+	{
+		std::vector<cl_device_id> devices;
+		cl_int err = context_devices(ctx, devices);
+		if (err != CL_SUCCESS)
+			return err;
+
+		clear();
+		std::lock_guard<std::mutex> l(lock);
+		this->ctx = ctx;
+		this->flags = flags;
+		align = 1;
+		for (size_t i = 0; i < devices.size(); i++) {
+			cl_uint bits = 0;
+			device_info(devices[i], CL_DEVICE_MEM_BASE_ADDR_ALIGN,
+					&bits);
+			if (bits / 8 > align)
+				align = bits / 8;
+		}
+		return CL_SUCCESS;
+	}
+
+
+	cl_int
+	create (const Context &ctx, cl_mem_flags flags = CL_MEM_READ_WRITE)
+	{
+		return create(ctx(), flags);
+	}
+
+
+	/**
+	 * smallest power of two class holding @size bytes, 0 if @size is
+	 * larger than the largest power of two
+	 */
+	size_t
+	size_class (size_t size) const
+	{
+		const size_t top = ~(~(size_t)0 >> 1);
+		if (size > top)
+			return 0;
+
+		size_t c = min_class ? min_class : 1;
+		while (c < size)
+			c <<= 1;
+		return c;
+	}
+
+
+	/**
+	 * get a memory object of at least @size bytes
+	 */
+	cl_int
+	allocate (size_t size, cl_mem *mem)
+	{
+		if (!ctx)
+			return CL_INVALID_CONTEXT;
+		if (!size)
+			return CL_INVALID_BUFFER_SIZE;
+
+		size_t c = size_class(size);
+		if (!c)
+			return CL_INVALID_BUFFER_SIZE;
+
+		std::lock_guard<std::mutex> l(lock);
+		cl_int err = CL_SUCCESS;
+		cl_mem m = NULL;
+
+		counters.requests++;
+		std::vector<cl_mem> &fl = free_lists[c];
+		if (!fl.empty()) {
+			m = fl.back();
+			fl.pop_back();
+			counters.hits++;
+			counters.idle -= c;
+		}
+		else if (c <= small_limit && c < slab_size)
+			err = carve(c, &m);
+		else
+			m = clCreateBuffer(ctx, flags, c, NULL, &err);
+		if (err != CL_SUCCESS)
+			return err;
+
+		live[m] = std::make_pair(c, size);
+		counters.requested += size;
+		counters.reserved += c;
+		*mem = m;
+		return CL_SUCCESS;
+	}
+
+
+	/**
+	 * let @buffer use pooled memory of @size bytes. the buffer does not own
+	 * the memory object and has to be given back with release()
+	 */
 	template <typename T>
 	cl_int
-	set_arg (unsigned int n, T arg)
+	allocate (Buffer<T> &buffer, size_t size)
 	{
-		return set_kernel_args(this->cl_obj, n, arg);
+		cl_mem m;
+		cl_int err = allocate(size, &m);
+		if (err != CL_SUCCESS)
+			return err;
+		buffer.reset(m, false);
+		buffer.size = size;
+		return CL_SUCCESS;
 	}
 
 
 	/**
-	 * create a kernel by name from a given program object
+	 * give a memory object back to the pool
 	 */
 	cl_int
-	create (const Program &program, const char *kernel_name)
+	release (cl_mem mem)
 	{
-		cl_int err;
-		this->cl_obj = clCreateKernel(program(), kernel_name, &err);
+		std::lock_guard<std::mutex> l(lock);
+		std::map<cl_mem, std::pair<size_t, size_t>>::iterator it =
+			live.find(mem);
+		if (it == live.end())
+			return CL_INVALID_MEM_OBJECT;
+
+		size_t c = it->second.first;
+		counters.requested -= it->second.second;
+		counters.reserved -= c;
+		counters.idle += c;
+		live.erase(it);
+		free_lists[c].push_back(mem);
+		return CL_SUCCESS;
+	}
+
+
+	template <typename T>
+	cl_int
+	release (Buffer<T> &buffer)
+	{
+		cl_int err = release(buffer());
+		if (err == CL_SUCCESS) {
+			buffer.reset();
+			buffer.size = 0;
+		}
 		return err;
 	}
 
 
+	BufferPoolStats
+	stats ()
+	{
+		std::lock_guard<std::mutex> l(lock);
+		return counters;
+	}
+
+
 	/**
-	 * run the kernel on the associated context/commandq.
+	 * release idle buffers that are not part of a slab
+	 */
+	void
+	trim ()
+	{
+		std::lock_guard<std::mutex> l(lock);
+		std::map<size_t, std::vector<cl_mem>>::iterator it;
+		for (it = free_lists.begin(); it != free_lists.end(); ++it) {
+			if (it->first <= small_limit && it->first < slab_size)
+				continue;
+			for (size_t i = 0; i < it->second.size(); i++)
+				clReleaseMemObject(it->second[i]);
+			counters.idle -= it->first * it->second.size();
+			it->second.clear();
+		}
+	}
+
+
+	/**
+	 * release all memory objects, including the ones that are still in use
+	 */
+	void
+	clear ()
+	{
+		std::lock_guard<std::mutex> l(lock);
+		std::map<size_t, std::vector<cl_mem>>::iterator it;
+		for (it = free_lists.begin(); it != free_lists.end(); ++it)
+			for (size_t i = 0; i < it->second.size(); i++)
+				release_unless_sub(it->second[i]);
+		std::map<cl_mem, std::pair<size_t, size_t>>::iterator lt;
+		for (lt = live.begin(); lt != live.end(); ++lt)
+			release_unless_sub(lt->first);
+
+		// sub-buffers have to go before their slabs
+		std::set<cl_mem>::iterator st;
+		for (st = sub_buffers.begin(); st != sub_buffers.end(); ++st)
+			clReleaseMemObject(*st);
+		for (size_t i = 0; i < slabs.size(); i++)
+			clReleaseMemObject(slabs[i]);
+
+		free_lists.clear();
+		live.clear();
+		current.clear();
+		sub_buffers.clear();
+		slabs.clear();
+		counters = BufferPoolStats();
+	}
+
+
+private:
+	void
+	release_unless_sub (cl_mem mem)
+	{
+		if (!sub_buffers.count(mem))
+			clReleaseMemObject(mem);
+	}
+
+
+	/**
+	 * create a sub-buffer of size class @c from the current slab of that
+	 * class, starting a new slab if it is exhausted
 	 */
 	cl_int
-	run (cl_uint work_dim, const size_t *global_work_size,
-			const size_t *local_work_size,
-			const size_t *global_work_offset = 0,
-			cl_uint num_events_in_wait_list = 0,
-			const cl_event 	*event_wait_list = NULL,
-			cl_event *event = NULL)
+	carve (size_t c, cl_mem *mem)
 	{
+		cl_int err;
+		size_t chunk = (c + align - 1) / align * align;
 
-		if (!(this->command_queue))
-			return CL_INVALID_COMMAND_QUEUE;
+		if (chunk > slab_size) {
+			*mem = clCreateBuffer(ctx, flags, c, NULL, &err);
+			return err;
+		}
+
+		std::map<size_t, Slab>::iterator it = current.find(c);
+		if (it == current.end()
+		    || it->second.next + chunk > it->second.size) {
+			Slab s;
+			s.size = slab_size / chunk * chunk;
+			s.next = 0;
+			s.mem = clCreateBuffer(ctx, flags, s.size, NULL, &err);
+			if (err != CL_SUCCESS)
+				return err;
+			slabs.push_back(s.mem);
+			counters.slabs += s.size;
+			it = current.insert(std::make_pair(c, s)).first;
+			it->second = s;
+		}
+
+		cl_buffer_region region = {it->second.next, c};
+		cl_mem_flags access = flags & (CL_MEM_READ_WRITE
+				| CL_MEM_WRITE_ONLY | CL_MEM_READ_ONLY);
+		*mem = clCreateSubBuffer(it->second.mem, access,
+				CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+		if (err != CL_SUCCESS)
+			return err;
 
-		return clEnqueueNDRangeKernel(this->command_queue->cl_obj,
-				this->cl_obj, work_dim, global_work_offset,
-				global_work_size, local_work_size,
-				num_events_in_wait_list, event_wait_list,
-				event);
+		it->second.next += chunk;
+		sub_buffers.insert(*mem);
+		return CL_SUCCESS;
 	}
 };
 
 
+#if defined(__unix__) || defined(__APPLE__)
+
+/**
+ * struct FileStream - streams a file of T values into device buffers chunk by
+ * chunk.
+ *
+ * The file is memory-mapped and copied chunk-wise into pinned staging buffers,
+ * which are uploaded to device buffers with non-blocking writes. Each chunk
+ * is handed to a processing function which enqueues its work after the
+ * upload. With @depth slots (2 = double buffering) the host reads chunk i+1
+ * from disk while chunk i is uploaded and processed, and the device buffer
+ * of a slot is only overwritten after the processing of its previous chunk
+ * has finished. To overlap uploads and kernels on the device as well, enqueue
+ * the processing on another queue than the uploads or use an out-of-order
+ * queue.
+ */
 template <typename T>
-struct Buffer: CLObjContainer<cl_mem, clReleaseMemObject>
-	       , CommandQueueJunction
+struct FileStream
 {
-	//! mapping pointer
-	T *ptr;
+	/**
+	 * processes one chunk. @first is the index of the first element of the
+	 * chunk in the file and @count the number of elements. the work has to
+	 * wait for @ready and should store its last event in @done
+	 */
+	typedef std::function<cl_int (Buffer<T> &chunk, size_t first,
+			size_t count, const EventList &ready, Event *done)>
+		process_type;
 
-	//! size of memory buffer object
-	size_t size;
 
+	const T *data;
+	size_t count;
+	size_t mapped_size;
 
-	Buffer (cl_mem buffer = NULL, bool release_on_destroy = true)
-		: CLObjContainer(buffer, release_on_destroy)
-		, ptr(NULL)
-		, size(0)
+	size_t chunk;
+	cl_command_queue queue;
+	std::vector<Buffer<T>> staging;
+	std::vector<Buffer<T>> device;
+
+
+	FileStream ()
+		: data(NULL)
+		, count(0)
+		, mapped_size(0)
+		, chunk(0)
+		, queue(NULL)
 	{}
 
 
-	cl_int
-	mallocHost (const cl_context ctx, size_t size,
-			cl_mem_flags flags = CL_MEM_READ_WRITE)
+	FileStream (const FileStream &) = delete;
+	FileStream& operator= (const FileStream &) = delete;
+
+
+	~FileStream ()
 	{
-		cl_int err;
-		cl_obj = clCreateBuffer(ctx,
-				CL_MEM_ALLOC_HOST_PTR | flags, size, NULL,
-				&err);
-		this->size = size;
-		return err;
+		close();
 	}
 
 
+	/**
+	 * map a file. the number of elements is the file size divided by
+	 * sizeof(T), trailing bytes are ignored
+	 */
 	cl_int
-	mallocHost (const Context &ctx, size_t size,
-			cl_mem_flags flags = CL_MEM_READ_WRITE)
+	open (const char *fname)
 	{
-		return mallocHost(ctx(), size, flags);
+		struct stat sb;
+		int fd = ::open(fname, O_RDONLY);
+		if (fd < 0)
+			return CL_INVALID_VALUE;
+		if (fstat(fd, &sb) < 0 || sb.st_size < (off_t)sizeof(T)) {
+			::close(fd);
+			return CL_INVALID_VALUE;
+		}
+
+		void *p = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if (p == MAP_FAILED)
+			return CL_OUT_OF_HOST_MEMORY;
+
+		unmap_file();
+		madvise(p, sb.st_size, MADV_SEQUENTIAL);
+		data = (const T*)p;
+		mapped_size = sb.st_size;
+		count = sb.st_size / sizeof(T);
+		return CL_SUCCESS;
 	}
 
 
-
+	/**
+	 * allocate @depth pinned staging buffers and device buffers of @chunk
+	 * elements each. the staging buffers stay mapped on @q
+	 */
 	cl_int
-	mallocDevice (const cl_context ctx, size_t size,
-			cl_mem_flags flags = CL_MEM_READ_WRITE)
+	create (const Context &ctx, const cl_command_queue q, size_t chunk,
+			size_t depth = 2)
 	{
 		cl_int err;
-		cl_obj = clCreateBuffer(ctx, flags, size, NULL, &err);
-		this->size = size;
-		return err;
+		if (!chunk || !depth)
+			return CL_INVALID_VALUE;
+
+		release_buffers();
+		this->chunk = chunk;
+		this->queue = q;
+		staging.resize(depth);
+		device.resize(depth);
+		for (size_t i = 0; i < depth; i++) {
+			err = staging[i].mallocHost(ctx, chunk * sizeof(T),
+					CL_MEM_READ_ONLY);
+			if (err == CL_SUCCESS)
+				err = device[i].mallocDevice(ctx,
+						chunk * sizeof(T),
+						CL_MEM_READ_ONLY);
+			if (err == CL_SUCCESS)
+				staging[i].map(q, &err, CL_MAP_WRITE);
+			if (err != CL_SUCCESS) {
+				release_buffers();
+				return err;
+			}
+		}
+		return CL_SUCCESS;
 	}
 
 
 	cl_int
-	mallocDevice (const Context &ctx, size_t size,
-			cl_mem_flags flags = CL_MEM_READ_WRITE)
+	create (const Context &ctx, const CommandQueue &q, size_t chunk,
+			size_t depth = 2)
 	{
-		return mallocDevice(ctx(), size, flags);
+		return create(ctx, q(), chunk, depth);
 	}
 
 
+	/**
+	 * stream the whole file through @process. uploads are enqueued on the
+	 * queue given to create(). returns when all chunks are processed
+	 */
+	cl_int
+	run (const process_type &process)
+	{
+		cl_int err = CL_SUCCESS;
+		if (!data || staging.empty())
+			return CL_INVALID_VALUE;
+
+		const size_t depth = staging.size();
+		std::vector<Event> uploaded(depth), done(depth);
+
+		for (size_t first = 0, i = 0; first < count; first += chunk, i++) {
+			const size_t s = i % depth;
+			const size_t n = std::min(chunk, count - first);
+
+			// the staging buffer may be refilled once the previous
+			// upload from it has finished
+			if (uploaded[s]()) {
+				err = uploaded[s].wait();
+				if (err != CL_SUCCESS)
+					break;
+			}
+
+			memcpy(staging[s].ptr, data + first, n * sizeof(T));
+
+			// the device buffer may be overwritten once the previous
+			// chunk in it has been processed
+			err = device[s].write(queue, staging[s].ptr,
+					EventList(done[s]), &uploaded[s],
+					n * sizeof(T));
+			if (err != CL_SUCCESS)
+				break;
+			clFlush(queue);
+
+			done[s].reset();
+			err = process(device[s], first, n, EventList(uploaded[s]),
+					&done[s]);
+			if (err != CL_SUCCESS)
+				break;
+			// without an event of the processing, the slot is free
+			// again after the upload
+			if (!done[s]()) {
+				clRetainEvent(uploaded[s]());
+				done[s].reset(uploaded[s]());
+			}
+		}
+
+		EventList pending;
+		for (size_t s = 0; s < depth; s++)
+			pending.add(done[s]);
+		cl_int werr = pending.wait();
+		return err != CL_SUCCESS ? err : werr;
+	}
 
-	T*
-	map (const cl_command_queue q, cl_int *err = NULL,
-			cl_map_flags flags = CL_MAP_READ | CL_MAP_WRITE,
-			cl_bool blocked = true)
+
+	void
+	close ()
 	{
-		cl_int e;
-		ptr = (T*)clEnqueueMapBuffer(q, this->cl_obj, blocked, flags, 0,
-				this->size, 0, NULL, NULL, &e);
-		if (err)
-			*err = e;
-		return ptr;
+		release_buffers();
+		unmap_file();
 	}
 
 
-	T*
-	map (const CommandQueue &q, cl_int *err = NULL,
-			cl_map_flags flags = CL_MAP_READ | CL_MAP_WRITE,
-			cl_bool blocked = true)
+private:
+	void
+	unmap_file ()
 	{
-		return this->map(q(), err, flags, blocked);
+		if (data)
+			munmap(const_cast<T*>(data), mapped_size);
+		data = NULL;
+		count = mapped_size = 0;
+	}
+
+
+	void
+	release_buffers ()
+	{
+		for (size_t i = 0; i < staging.size(); i++)
+			if (staging[i].ptr) {
+				staging[i].unmap(queue);
+				staging[i].ptr = NULL;
+			}
+		if (queue && !staging.empty())
+			clFinish(queue);
+		staging.clear();
+		device.clear();
+	}
+};
+
+#endif /* __unix__ || __APPLE__ */
+
+
+/**
+ * struct Pipeline - streams chunks through host fill, upload, kernel, download
+ * and host consume stages.
+ *
+ * Every slot has a pinned staging buffer and a device buffer for the input
+ * and the output. The slots rotate through the stages, consecutive stages of
+ * a chunk are linked by events and uploads, kernels and downloads are
+ * enqueued on their own queues. With three slots the host fills chunk i+2
+ * while chunk i+1 is uploaded, chunk i is processed and chunk i-1 is
+ * downloaded. Chunks are consumed in order.
+ *
+ *	fill:		writes up to 'chunk' input elements for chunk @index to
+ *			@host and returns their number, 0 ends the stream
+ *	compute:	enqueues the work on @q after @ready, stores its last
+ *			event in @done and the number of output elements in
+ *			@out_count (initialized to the number of inputs)
+ *	consume:	receives the output of chunk @index
+ */
+template <typename In, typename Out = In>
+struct Pipeline
+{
+	typedef std::function<size_t (In *host, size_t index)> fill_type;
+
+	typedef std::function<cl_int (Buffer<In> &in, Buffer<Out> &out,
+			size_t count, cl_command_queue q,
+			const EventList &ready, Event *done,
+			size_t *out_count)> compute_type;
+
+	typedef std::function<void (const Out *host, size_t count,
+			size_t index)> consume_type;
+
+
+	struct Slot
+	{
+		Buffer<In> in_staging;
+		Buffer<In> in_device;
+		Buffer<Out> out_device;
+		Buffer<Out> out_staging;
+
+		Event uploaded;
+		Event computed;
+		Event downloaded;
+
+		//! chunk currently in the slot and its number of outputs
+		size_t index;
+		size_t out_count;
+		bool busy;
+
+		Slot () : index(0), out_count(0), busy(false) {}
+	};
+
+
+	size_t in_chunk;
+	size_t out_chunk;
+	cl_command_queue upload_q;
+	cl_command_queue compute_q;
+	cl_command_queue download_q;
+	std::vector<Slot> slots;
+
+
+	Pipeline ()
+		: in_chunk(0)
+		, out_chunk(0)
+		, upload_q(NULL)
+		, compute_q(NULL)
+		, download_q(NULL)
+	{}
+
+
+	Pipeline (const Pipeline &) = delete;
+	Pipeline& operator= (const Pipeline &) = delete;
+
+
+	~Pipeline ()
+	{
+		release();
 	}
 
 
+	/**
+	 * allocate @depth slots for chunks of @in_chunk input and @out_chunk
+	 * output elements. the queues have to belong to @ctx, they may be the
+	 * same queue
+	 */
 	cl_int
-	unmap (const cl_command_queue q, cl_event *event = NULL)
+	create (const Context &ctx, const cl_command_queue upload_q,
+			const cl_command_queue compute_q,
+			const cl_command_queue download_q, size_t in_chunk,
+			size_t out_chunk, size_t depth = 3)
 	{
-		cl_int err;
-		cl_event e;
-		err = clEnqueueUnmapMemObject(q, this->cl_obj, (void*)ptr, 0,
-				NULL, &e);
-		if (event)
-			*event = e;
+		cl_int err = CL_SUCCESS;
+		if (!in_chunk || !out_chunk || !depth)
+			return CL_INVALID_VALUE;
+
+		release();
+		this->in_chunk = in_chunk;
+		this->out_chunk = out_chunk;
+		this->upload_q = upload_q;
+		this->compute_q = compute_q;
+		this->download_q = download_q;
+
+		slots.resize(depth);
+		const size_t in_size = in_chunk * sizeof(In);
+		const size_t out_size = out_chunk * sizeof(Out);
+		for (size_t i = 0; i < depth && err == CL_SUCCESS; i++) {
+			Slot &s = slots[i];
+			err = s.in_staging.mallocHost(ctx, in_size,
+					CL_MEM_READ_ONLY);
+			if (err == CL_SUCCESS)
+				err = s.in_device.mallocDevice(ctx, in_size,
+						CL_MEM_READ_ONLY);
+			if (err == CL_SUCCESS)
+				err = s.out_device.mallocDevice(ctx, out_size,
+						CL_MEM_WRITE_ONLY);
+			if (err == CL_SUCCESS)
+				err = s.out_staging.mallocHost(ctx, out_size,
+						CL_MEM_WRITE_ONLY);
+			if (err == CL_SUCCESS)
+				s.in_staging.map(upload_q, &err, CL_MAP_WRITE);
+			if (err == CL_SUCCESS)
+				s.out_staging.map(download_q, &err,
+						CL_MAP_READ);
+		}
+		if (err != CL_SUCCESS)
+			release();
 		return err;
 	}
 
 
 	cl_int
-	unmap (const CommandQueue &q, cl_event *event = NULL)
+	create (const Context &ctx, const CommandQueue &upload_q,
+			const CommandQueue &compute_q,
+			const CommandQueue &download_q, size_t in_chunk,
+			size_t out_chunk, size_t depth = 3)
 	{
-		return this->unmap(q(), event);
+		return create(ctx, upload_q(), compute_q(), download_q(),
+				in_chunk, out_chunk, depth);
+	}
+
+
+	/**
+	 * run chunks through the pipeline until @fill returns 0
+	 */
+	cl_int
+	run (const fill_type &fill, const compute_type &compute,
+			const consume_type &consume)
+	{
+		cl_int err = CL_SUCCESS;
+		if (slots.empty())
+			return CL_INVALID_VALUE;
+
+		for (size_t i = 0; ; i++) {
+			Slot &s = slots[i % slots.size()];
+
+			// the slot is free once its previous chunk has been
+			// downloaded and consumed
+			err = drain(s, consume);
+			if (err != CL_SUCCESS)
+				break;
+
+			size_t n = fill(s.in_staging.ptr, i);
+			if (!n)
+				break;
+			if (n > in_chunk) {
+				err = CL_INVALID_BUFFER_SIZE;
+				break;
+			}
+
+			err = s.in_device.write(upload_q, s.in_staging.ptr,
+					EventList(), &s.uploaded, n * sizeof(In));
+			if (err != CL_SUCCESS)
+				break;
+
+			s.computed.reset();
+			s.out_count = n;
+			err = compute(s.in_device, s.out_device, n, compute_q,
+					EventList(s.uploaded), &s.computed,
+					&s.out_count);
+			if (err != CL_SUCCESS)
+				break;
+			if (s.out_count > out_chunk) {
+				err = CL_INVALID_BUFFER_SIZE;
+				break;
+			}
+
+			EventList ready(s.computed.cl_obj ? s.computed
+							  : s.uploaded);
+			err = s.out_device.read(download_q, s.out_staging.ptr,
+					ready, &s.downloaded,
+					s.out_count * sizeof(Out));
+			if (err != CL_SUCCESS)
+				break;
+
+			s.index = i;
+			s.busy = true;
+			clFlush(upload_q);
+			clFlush(compute_q);
+			clFlush(download_q);
+		}
+
+		// consume the chunks still in flight in order. the slot after
+		// the last filled one holds the oldest chunk
+		size_t oldest = 0;
+		for (size_t i = 0; i < slots.size(); i++)
+			if (slots[i].busy && (!slots[oldest].busy
+			    || slots[i].index < slots[oldest].index))
+				oldest = i;
+		for (size_t i = 0; i < slots.size(); i++) {
+			cl_int e = drain(slots[(oldest + i) % slots.size()],
+					consume);
+			if (err == CL_SUCCESS)
+				err = e;
+		}
+		return err;
 	}
 
 
+	void
+	release ()
+	{
+		for (size_t i = 0; i < slots.size(); i++) {
+			if (slots[i].in_staging.ptr)
+				slots[i].in_staging.unmap(upload_q);
+			if (slots[i].out_staging.ptr)
+				slots[i].out_staging.unmap(download_q);
+		}
+		if (!slots.empty()) {
+			clFinish(upload_q);
+			clFinish(download_q);
+		}
+		slots.clear();
+	}
+
 
-	// TODO: extend for events! reflect in other copy_to functions
-	// TODO: provide operator= for copy operation
+private:
+	/**
+	 * wait for the download of the chunk in @s and consume it
+	 */
 	cl_int
-	copy_to (const cl_command_queue q, Buffer<T> &buffer, size_t size = 0,
-		size_t src_offset = 0, size_t dst_offset = 0)
+	drain (Slot &s, const consume_type &consume)
 	{
-		if (size == 0)
-			size = this->size;
+		if (!s.busy)
+			return CL_SUCCESS;
+
+		s.busy = false;
+		cl_int err = s.downloaded.wait();
+		if (err != CL_SUCCESS)
+			return err;
+		consume(s.out_staging.ptr, s.out_count, s.index);
+		return CL_SUCCESS;
+	}
+};
+
+
+/**
+ * struct TileStream - streams the tiles of a large 2D host array through the
+ * device with rectangular transfers.
+ *
+ * Each tile is uploaded from its place in the pitched host array straight
+ * into a packed device buffer, processed, and the result is downloaded
+ * straight into its place in the output array, so no tile is ever packed on
+ * the host. Tiles may be extended by a @halo of input elements on each side
+ * (clamped to the array) for stencils. Like Pipeline, @depth slots rotate
+ * through upload, compute and download on their own queues.
+ *
+ *	compute:	enqueues the work for @tile (output coordinates) on @q
+ *			after @ready and stores its last event in @done. @in
+ *			holds the packed input box @in_rect, @out receives the
+ *			packed output of @tile
+ */
+template <typename In, typename Out = In>
+struct TileStream
+{
+	typedef std::function<cl_int (Buffer<In> &in, const Rect &in_rect,
+			Buffer<Out> &out, const Rect &tile, cl_command_queue q,
+			const EventList &ready, Event *done)> compute_type;
+
+
+	struct Slot
+	{
+		Buffer<In> in;
+		Buffer<Out> out;
+
+		Event uploaded;
+		Event computed;
+		Event downloaded;
+		bool busy;
+
+		Slot () : busy(false) {}
+	};
+
+
+	size_t tile_width;
+	size_t tile_height;
+	size_t halo;
+	cl_command_queue upload_q;
+	cl_command_queue compute_q;
+	cl_command_queue download_q;
+	std::vector<Slot> slots;
+
+
+	TileStream ()
+		: tile_width(0)
+		, tile_height(0)
+		, halo(0)
+		, upload_q(NULL)
+		, compute_q(NULL)
+		, download_q(NULL)
+	{}
+
+
+	TileStream (const TileStream &) = delete;
+	TileStream& operator= (const TileStream &) = delete;
 
-		return clEnqueueCopyBuffer(q, this->cl_obj, buffer(),
-				src_offset, dst_offset, size, 0, NULL, NULL);
 
+	~TileStream ()
+	{
+		release();
 	}
 
 
+	/**
+	 * allocate @depth slots for tiles of @tile_width x @tile_height
+	 * elements with @halo extra input elements on each side. the queues
+	 * have to belong to @ctx, they may be the same queue
+	 */
 	cl_int
-	copy_to (const CommandQueue &q, Buffer<T> &buffer, size_t size = 0,
-		size_t src_offset = 0, size_t dst_offset = 0)
+	create (const Context &ctx, const cl_command_queue upload_q,
+			const cl_command_queue compute_q,
+			const cl_command_queue download_q, size_t tile_width,
+			size_t tile_height, size_t halo = 0, size_t depth = 2)
 	{
-		return copy_to(q(), buffer, size, src_offset, dst_offset);
+		cl_int err = CL_SUCCESS;
+		if (!tile_width || !tile_height || !depth)
+			return CL_INVALID_VALUE;
+
+		release();
+		this->tile_width = tile_width;
+		this->tile_height = tile_height;
+		this->halo = halo;
+		this->upload_q = upload_q;
+		this->compute_q = compute_q;
+		this->download_q = download_q;
+
+		slots.resize(depth);
+		const size_t in_size = (tile_width + 2 * halo)
+			* (tile_height + 2 * halo) * sizeof(In);
+		const size_t out_size = tile_width * tile_height * sizeof(Out);
+		for (size_t i = 0; i < depth && err == CL_SUCCESS; i++) {
+			err = slots[i].in.mallocDevice(ctx, in_size,
+					CL_MEM_READ_ONLY);
+			if (err == CL_SUCCESS)
+				err = slots[i].out.mallocDevice(ctx, out_size,
+						CL_MEM_WRITE_ONLY);
+		}
+		if (err != CL_SUCCESS)
+			release();
+		return err;
+	}
+
+
+	cl_int
+	create (const Context &ctx, const CommandQueue &upload_q,
+			const CommandQueue &compute_q,
+			const CommandQueue &download_q, size_t tile_width,
+			size_t tile_height, size_t halo = 0, size_t depth = 2)
+	{
+		return create(ctx, upload_q(), compute_q(), download_q(),
+				tile_width, tile_height, halo, depth);
 	}
 
 
 	/**
-	 * copy_to function when the buffer is already bound to a command queue
+	 * process the @width x @height array @src with rows @src_pitch
+	 * elements apart into @dst with rows @dst_pitch elements apart (0 for
+	 * packed arrays). the tiles are processed in row-major order and the
+	 * function returns when all of them have been downloaded. @src and
+	 * @dst should be pinned or page aligned memory for full transfer
+	 * speed
 	 */
 	cl_int
-	copy_to (Buffer<T> &buffer, size_t size = 0, size_t src_offset = 0,
-			size_t dst_offset = 0)
+	run (const In *src, size_t src_pitch, Out *dst, size_t dst_pitch,
+			size_t width, size_t height,
+			const compute_type &compute)
 	{
-		if (!(this->command_queue))
-			return CL_INVALID_COMMAND_QUEUE;
+		cl_int err = CL_SUCCESS;
+		if (slots.empty())
+			return CL_INVALID_VALUE;
+		if (!src_pitch)
+			src_pitch = width;
+		if (!dst_pitch)
+			dst_pitch = width;
+
+		size_t i = 0;
+		for (size_t y = 0; y < height && err == CL_SUCCESS;
+				y += tile_height)
+		for (size_t x = 0; x < width && err == CL_SUCCESS;
+				x += tile_width, i++) {
+			Slot &s = slots[i % slots.size()];
+
+			// the device buffers of the slot are free once the
+			// previous tile has been downloaded
+			err = drain(s);
+			if (err != CL_SUCCESS)
+				break;
+
+			Rect tile = Rect(std::min(tile_width, width - x),
+					std::min(tile_height, height - y))
+				.at(x, y);
+			size_t x0 = x > halo ? x - halo : 0;
+			size_t y0 = y > halo ? y - halo : 0;
+			Rect in_rect = Rect(
+					std::min(width, x + tile.width + halo) - x0,
+					std::min(height, y + tile.height + halo) - y0)
+				.at(x0, y0);
+
+			err = s.in.write_rect(upload_q, src,
+					Rect(in_rect).pitch(src_pitch),
+					Rect(), EventList(), &s.uploaded);
+			if (err != CL_SUCCESS)
+				break;
+
+			// from here on the slot has work in flight, even if a
+			// later step fails
+			s.busy = true;
+			s.computed.reset();
+			s.downloaded.reset();
+			err = compute(s.in, in_rect, s.out, tile, compute_q,
+					EventList(s.uploaded), &s.computed);
+			if (err != CL_SUCCESS)
+				break;
+
+			EventList ready(s.computed.cl_obj ? s.computed
+							  : s.uploaded);
+			err = s.out.read_rect(download_q, dst,
+					Rect(tile.width, tile.height),
+					Rect().at(x, y).pitch(dst_pitch), ready,
+					&s.downloaded);
+			if (err != CL_SUCCESS)
+				break;
+
+			clFlush(upload_q);
+			clFlush(compute_q);
+			clFlush(download_q);
+		}
+
+		for (size_t j = 0; j < slots.size(); j++) {
+			cl_int e = drain(slots[j]);
+			if (err == CL_SUCCESS)
+				err = e;
+		}
+		return err;
+	}
 
-		return copy_to(*(this->command_queue), buffer, size, src_offset,
-				dst_offset);
+
+	void
+	release ()
+	{
+		for (size_t i = 0; i < slots.size(); i++)
+			drain(slots[i]);
+		slots.clear();
 	}
 
 
+private:
+	cl_int
+	drain (Slot &s)
+	{
+		if (!s.busy)
+			return CL_SUCCESS;
+
+		// the tile may have failed before its download was enqueued, so
+		// wait for every step that was
+		cl_int err = CL_SUCCESS;
+		Event *steps[] = {&s.downloaded, &s.computed, &s.uploaded};
+		for (size_t i = 0; i < 3; i++) {
+			if (!steps[i]->cl_obj)
+				continue;
+			cl_int e = steps[i]->wait();
+			if (err == CL_SUCCESS)
+				err = e;
+		}
+		s.busy = false;
+		return err;
+	}
 };
 
 
@@ -0,0 +1,11 @@
+__kernel void
+empty ()
+{
+}
+
+
+__kernel void
+args (__global float *a, __global const float *b, const unsigned int n,
+		const float f)
+{
+}
@@ -0,0 +1,438 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <future>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <CL/cl.h>
+#include "cl_0x.hpp"
+
+/*
+ * micro benchmarks for the cl_0x wrappers. results are written to stdout as
+ * CSV with the columns
+ *
+ *	device,benchmark,variant,size,iterations,time_ns,value,unit
+ *
+ * where time_ns is the average time of one iteration. progress and errors go
+ * to stderr.
+ */
+
+#ifndef DOTPROD_CL
+#define DOTPROD_CL "../stupid_dot_product/cl/dotprod.cl"
+#endif
+
+#ifndef BENCH_CL
+#define BENCH_CL "cl/bench.cl"
+#endif
+
+
+static std::string devname;
+
+
+static void
+die (const char *errmsg, ...)
+{
+	va_list ap;
+	va_start(ap, errmsg);
+	vfprintf(stderr, errmsg, ap);
+	va_end(ap);
+	exit(EXIT_FAILURE);
+}
+
+
+static double
+now ()
+{
+	return std::chrono::duration<double, std::nano>(
+			std::chrono::steady_clock::now().time_since_epoch())
+		.count();
+}
+
+
+static void
+report (const char *bench, const char *variant, size_t size, int iterations,
+		double ns, double value, const char *unit)
+{
+	printf("%s,%s,%s,%zu,%d,%.0f,%.6g,%s\n", devname.c_str(), bench,
+			variant, size, iterations, ns, value, unit);
+	fflush(stdout);
+}
+
+
+/*
+ * number of iterations to move at least 256MB, but at least 3
+ */
+static int
+iterations_for (size_t size)
+{
+	size_t n = (256 << 20) / size;
+	return (int)std::max<size_t>(n, 3);
+}
+
+
+static void
+bench_bandwidth (const cl_0x::Context &ctx, const cl_0x::CommandQueue &q)
+{
+	for (size_t size = 4 << 10; size <= (64 << 20); size *= 4) {
+		const int iters = iterations_for(size);
+		cl_0x::Buffer<char> dev, pinned, mapped;
+		std::vector<char> pageable(size, 1);
+		cl_int err;
+		double t0, t;
+
+		err = dev.mallocDevice(ctx, size);
+		if (err == CL_SUCCESS)
+			err = pinned.mallocHost(ctx, size);
+		if (err == CL_SUCCESS)
+			err = mapped.mallocHost(ctx, size);
+		if (err != CL_SUCCESS)
+			die("ERROR: Could not allocate %zu bytes\n", size);
+		char *p = pinned.map(q, &err);
+		if (err != CL_SUCCESS)
+			die("ERROR: Could not map pinned memory\n");
+
+		// pageable host memory
+		t0 = now();
+		for (int i = 0; i < iters && err == CL_SUCCESS; i++)
+			err = dev.write(q, &pageable[0], cl_0x::EventList(),
+					NULL, size, 0, CL_TRUE);
+		t = (now() - t0) / iters;
+		report("bandwidth", "pageable_h2d", size, iters, t, size / t,
+				"GB/s");
+
+		t0 = now();
+		for (int i = 0; i < iters && err == CL_SUCCESS; i++)
+			err = dev.read(q, &pageable[0], cl_0x::EventList(),
+					NULL, size, 0, CL_TRUE);
+		t = (now() - t0) / iters;
+		report("bandwidth", "pageable_d2h", size, iters, t, size / t,
+				"GB/s");
+
+		// pinned host memory, mapped once
+		t0 = now();
+		for (int i = 0; i < iters && err == CL_SUCCESS; i++)
+			err = dev.write(q, p, cl_0x::EventList(), NULL, size,
+					0, CL_TRUE);
+		t = (now() - t0) / iters;
+		report("bandwidth", "pinned_h2d", size, iters, t, size / t,
+				"GB/s");
+
+		t0 = now();
+		for (int i = 0; i < iters && err == CL_SUCCESS; i++)
+			err = dev.read(q, p, cl_0x::EventList(), NULL, size, 0,
+					CL_TRUE);
+		t = (now() - t0) / iters;
+		report("bandwidth", "pinned_d2h", size, iters, t, size / t,
+				"GB/s");
+
+		// map, copy and unmap for every transfer
+		t0 = now();
+		for (int i = 0; i < iters && err == CL_SUCCESS; i++) {
+			char *m = mapped.map(q, &err, CL_MAP_WRITE);
+			if (err != CL_SUCCESS)
+				break;
+			memcpy(m, &pageable[0], size);
+			err = mapped.unmap(q);
+			if (err == CL_SUCCESS)
+				err = q.finish();
+		}
+		t = (now() - t0) / iters;
+		report("bandwidth", "mapped_h2d", size, iters, t, size / t,
+				"GB/s");
+
+		t0 = now();
+		for (int i = 0; i < iters && err == CL_SUCCESS; i++) {
+			char *m = mapped.map(q, &err, CL_MAP_READ);
+			if (err != CL_SUCCESS)
+				break;
+			memcpy(&pageable[0], m, size);
+			err = mapped.unmap(q);
+			if (err == CL_SUCCESS)
+				err = q.finish();
+		}
+		t = (now() - t0) / iters;
+		report("bandwidth", "mapped_d2h", size, iters, t, size / t,
+				"GB/s");
+
+		pinned.unmap(q);
+		q.finish();
+		if (err != CL_SUCCESS)
+			die("ERROR: Transfer of %zu bytes failed\n", size);
+	}
+}
+
+
+static void
+bench_launch (const cl_0x::CommandQueue &q, cl_0x::Kernel &kernel)
+{
+	const int iters = 10000;
+	const size_t global = 1;
+	cl_int err = CL_SUCCESS;
+	double t0, t;
+
+	// warm up
+	err = kernel.run(q, 1, &global, NULL, cl_0x::EventList());
+	if (err == CL_SUCCESS)
+		err = q.finish();
+
+	// every launch waits for the kernel to finish
+	t0 = now();
+	for (int i = 0; i < iters && err == CL_SUCCESS; i++) {
+		cl_0x::Event e;
+		err = kernel.run(q, 1, &global, NULL, cl_0x::EventList(), &e);
+		if (err == CL_SUCCESS)
+			err = e.wait();
+	}
+	t = (now() - t0) / iters;
+	report("launch", "sync", 0, iters, t, t / 1000.0, "us");
+
+	// back to back launches
+	t0 = now();
+	for (int i = 0; i < iters && err == CL_SUCCESS; i++)
+		err = kernel.run(q, 1, &global, NULL, cl_0x::EventList());
+	if (err == CL_SUCCESS)
+		err = q.finish();
+	t = (now() - t0) / iters;
+	report("launch", "async", 0, iters, t, t / 1000.0, "us");
+
+	if (err != CL_SUCCESS)
+		die("ERROR: Could not launch empty kernel\n");
+}
+
+
+/*
+ * launches from the workers of a dispatcher, every worker uses its own queue
+ * and kernel instance. the size column holds the number of workers
+ */
+static void
+bench_dispatch (const cl_0x::Context &ctx, const cl_0x::Device &device,
+		const cl_0x::Program &program)
+{
+	const int iters = 10000;
+	const size_t global = 1;
+	cl_0x::Dispatcher dispatcher;
+	std::vector<std::future<cl_int>> results(iters);
+	cl_int err;
+	double t0, t;
+
+	err = dispatcher.create(ctx, device, program);
+	if (err != CL_SUCCESS)
+		die("ERROR: Could not create dispatcher\n");
+	const size_t empty = dispatcher.find("empty");
+
+	t0 = now();
+	for (int i = 0; i < iters; i++)
+		results[i] = dispatcher.submit(
+				[&](cl_0x::Dispatcher::Worker &w) {
+			return w.kernels[empty].run(1, &global, NULL,
+					cl_0x::EventList());
+		});
+	// the tasks refer to locals, collect all of them before leaving
+	for (int i = 0; i < iters; i++) {
+		cl_int e = results[i].get();
+		if (err == CL_SUCCESS)
+			err = e;
+	}
+	cl_int e = dispatcher.finish();
+	if (err == CL_SUCCESS)
+		err = e;
+	t = (now() - t0) / iters;
+	report("launch", "dispatch", dispatcher.pool.size(), iters, t,
+			t / 1000.0, "us");
+
+	if (err != CL_SUCCESS)
+		die("ERROR: Could not dispatch empty kernel\n");
+}
+
+
+static void
+bench_set_args (const cl_0x::Context &ctx, const cl_0x::Program &program)
+{
+	typedef cl_0x::KernelFunctor<cl_0x::Buffer<float>, cl_0x::Buffer<float>,
+		cl_uint, cl_float> functor;
+
+	const int iters = 100000;
+	cl_0x::Buffer<float> a, b;
+	functor f;
+	cl_int err;
+	double t0, t;
+
+	err = a.mallocDevice(ctx, 1024);
+	if (err == CL_SUCCESS)
+		err = b.mallocDevice(ctx, 1024);
+	if (err == CL_SUCCESS)
+		err = f.create(program, "args");
+	if (err != CL_SUCCESS)
+		die("ERROR: Could not set up set_args benchmark\n");
+
+	t0 = now();
+	for (int i = 0; i < iters && err == CL_SUCCESS; i++)
+		err = f.set_args(a, b, (cl_uint)i, 1.0f);
+	t = (now() - t0) / iters;
+	report("set_args", "set_args", 4, iters, t, t, "ns");
+
+	f.invalidate();
+	t0 = now();
+	for (int i = 0; i < iters && err == CL_SUCCESS; i++)
+		err = f.bind(a, b, 16u, 1.0f);
+	t = (now() - t0) / iters;
+	report("set_args", "functor_unchanged", 4, iters, t, t, "ns");
+
+	t0 = now();
+	for (int i = 0; i < iters && err == CL_SUCCESS; i++)
+		err = f.bind(a, b, (cl_uint)i, 1.0f);
+	t = (now() - t0) / iters;
+	report("set_args", "functor_one_changed", 4, iters, t, t, "ns");
+
+	if (err != CL_SUCCESS)
+		die("ERROR: Could not set kernel arguments\n");
+}
+
+
+/*
+ * run one specialization of the dot product kernel for all problem sizes
+ */
+static void
+bench_dotprod (const cl_0x::Context &ctx, const cl_0x::CommandQueue &q,
+		cl_0x::ProgramVariants &variants, unsigned width)
+{
+	cl_0x::BuildOptions opts;
+	cl_0x::Program program;
+	cl_0x::Kernel kernel;
+	char variant[32];
+
+	opts.define("VECTOR_WIDTH", width);
+	if (variants.get(opts, program) != CL_SUCCESS
+	    || kernel.create(program, "dotprod") != CL_SUCCESS)
+		die("ERROR: Could not create dotprod kernel (width %u)\n",
+				width);
+
+	for (cl_uint dim = 1 << 14; dim <= (1 << 24); dim *= 4) {
+		const int iters = 10;
+		const size_t memsize = sizeof(cl_float) * dim;
+		const size_t threads = std::min<size_t>(dim, 1024);
+		cl_0x::Buffer<float> dst, a, b;
+		std::vector<float> h(dim, 1.0f);
+		cl_int err;
+
+		err = dst.mallocDevice(ctx, sizeof(cl_float) * threads);
+		if (err == CL_SUCCESS)
+			err = a.mallocDevice(ctx, memsize, CL_MEM_READ_ONLY);
+		if (err == CL_SUCCESS)
+			err = b.mallocDevice(ctx, memsize, CL_MEM_READ_ONLY);
+		if (err == CL_SUCCESS)
+			err = a.write(q, &h[0], cl_0x::EventList(), NULL, 0, 0,
+					CL_TRUE);
+		if (err == CL_SUCCESS)
+			err = b.write(q, &h[0], cl_0x::EventList(), NULL, 0, 0,
+					CL_TRUE);
+		if (err == CL_SUCCESS)
+			err = kernel.set_args(dst, a, b, dim);
+		if (err != CL_SUCCESS)
+			die("ERROR: Could not set up dotprod for %u\n", dim);
+
+		// device time from profiling events, the first run is a
+		// warm-up
+		double total = 0.0;
+		for (int i = 0; i <= iters && err == CL_SUCCESS; i++) {
+			cl_0x::Event e;
+			cl_0x::EventTimes times;
+			err = kernel.run(q, 1, &threads, NULL,
+					cl_0x::EventList(), &e);
+			if (err == CL_SUCCESS)
+				err = e.wait();
+			if (err == CL_SUCCESS)
+				err = e.times(&times);
+			if (err == CL_SUCCESS && i)
+				total += times.exec_time();
+		}
+		if (err != CL_SUCCESS)
+			die("ERROR: Could not run dotprod for %u\n", dim);
+
+		double t = total / iters;
+		snprintf(variant, sizeof(variant), "bandwidth_vec%u", width);
+		report("dotprod", variant, dim, iters, t, 2.0 * memsize / t,
+				"GB/s");
+		snprintf(variant, sizeof(variant), "compute_vec%u", width);
+		report("dotprod", variant, dim, iters, t, 2.0 * dim / t,
+				"GFLOP/s");
+	}
+}
+
+
+/*
+ * the host SIMD dot product for the sizes of the device benchmark, to find
+ * the crossover between host and device
+ */
+static void
+bench_host_dotprod ()
+{
+	static const char *variants[] = {"host_scalar", "host_sse2", "host_avx2"};
+	const char *variant = variants[cl_0x::host_simd()];
+
+	for (cl_uint dim = 1 << 10; dim <= (1 << 24); dim *= 4) {
+		const int iters = iterations_for(sizeof(cl_float) * dim);
+		std::vector<float> a(dim, 1.0f), b(dim, 3.0f);
+		volatile float sink = 0.0f;
+
+		double t0 = now();
+		for (int i = 0; i < iters; i++)
+			sink = sink + cl_0x::host_dot(&a[0], &b[0], dim);
+		double t = (now() - t0) / iters;
+		report("dotprod", variant, dim, iters, t, 2.0 * dim / t,
+				"GFLOP/s");
+	}
+}
+
+
+int
+main ()
+{
+	cl_int err;
+	cl_0x::Platform platform;
+	cl_0x::Device device;
+	cl_0x::DeviceInfo info;
+	cl_0x::Context ctx;
+	cl_0x::CommandQueue q;
+	cl_0x::Program bench;
+	cl_0x::ProgramVariants dotprod;
+	cl_0x::KernelRegistry kernels;
+	cl_0x::Kernel *empty;
+
+	err = cl_0x::select_device(platform, device,
+			cl_0x::DEVICE_MOST_COMPUTE_UNITS, DEVICE_TYPE, NULL,
+			&info);
+	if (err != CL_SUCCESS)
+		die("ERROR: Could not open OpenCL device (%d)\n", err);
+	if (ctx.create(platform, device) != CL_SUCCESS)
+		die("ERROR: Could not create context\n");
+	if (q.create(device, ctx, CL_QUEUE_PROFILING_ENABLE) != CL_SUCCESS)
+		die("ERROR: Could not create command queue\n");
+	if (bench.build_from_file(ctx, BENCH_CL) != CL_SUCCESS)
+		die("ERROR: Could not build %s\n", BENCH_CL);
+	if (dotprod.create_from_file(ctx, DOTPROD_CL) != CL_SUCCESS)
+		die("ERROR: Could not read %s\n", DOTPROD_CL);
+	if (kernels.create(bench, device) != CL_SUCCESS
+	    || !(empty = kernels.get("empty")))
+		die("ERROR: Could not create the kernels of %s\n", BENCH_CL);
+
+	// the device name is the first column, keep it free of separators
+	devname = info.platform_name + " " + info.name;
+	std::replace(devname.begin(), devname.end(), ',', ' ');
+	fprintf(stderr, "benchmarking %s\n", devname.c_str());
+
+	printf("device,benchmark,variant,size,iterations,time_ns,value,unit\n");
+	bench_bandwidth(ctx, q);
+	bench_launch(q, *empty);
+	bench_dispatch(ctx, device, bench);
+	bench_set_args(ctx, bench);
+	for (unsigned width = 1; width <= 16; width *= 2)
+		bench_dotprod(ctx, q, dotprod, width);
+	bench_host_dotprod();
+
+	return 0;
+}
@@ -1,21 +1,91 @@
+/*
+ * dot product kernel family. every work-item accumulates a strided range of
+ * vectors in registers, so consecutive work-items read consecutive vectors.
+ * the variants are selected at build time:
+ *
+ *	-D VECTOR_WIDTH=n	elements per load and multiply, one of 1, 2, 4,
+ *				8 or 16 (default 1). choose it according to
+ *				CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT
+ *	-D USE_DOUBLE		double instead of float elements, requires
+ *				cl_khr_fp64
+ *	-D WG_SIZE=n		reduce the sums of a work-group in local memory
+ *				and write one partial sum per work-group instead
+ *				of one per work-item. the kernel then has to be
+ *				launched with a local work size of n, which has
+ *				to be a power of two
+ *
+ * dst receives the partial sums which still have to be added up, e.g. with
+ * cl_0x::Reduction.
+ */
+
+#ifdef USE_DOUBLE
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double real;
+#else
+typedef float real;
+#endif
+
+#ifndef VECTOR_WIDTH
+#define VECTOR_WIDTH 1
+#endif
+
+#define CAT_(a, b) a ## b
+#define CAT(a, b) CAT_(a, b)
+
+#if VECTOR_WIDTH == 1
+typedef real realv;
+#define LOAD(i, p) ((p)[i])
+#else
+typedef CAT(real, VECTOR_WIDTH) realv;
+#define LOAD(i, p) CAT(vload, VECTOR_WIDTH)(i, p)
+#endif
+
+
+#ifdef WG_SIZE
+__attribute__((reqd_work_group_size(WG_SIZE, 1, 1)))
+#endif
 __kernel void
-dotprod (__global float *dst, __global const float *a, __global const float *b,
+dotprod (__global real *dst, __global const real *a, __global const real *b,
 		const unsigned int dim)
 {
-	// calculate how many items one thread has to compute
-	size_t iter = floor(dim / get_global_size(0));
-	size_t pos = get_global_id(0);
-	const size_t idx = get_global_id(0);
+	const unsigned int gid = get_global_id(0);
+	const unsigned int stride = get_global_size(0);
+	const unsigned int nvec = dim / VECTOR_WIDTH;
 
-	// clear the output
-	dst[pos] = 0.0f;
+	// accumulate in registers, the result is written only once
+	realv acc = 0;
+	for (unsigned int i = gid; i < nvec; i += stride)
+		acc += LOAD(i, a) * LOAD(i, b);
 
-	for (int i = 0; i < iter; i++) {
-		dst[idx] += a[pos] * b[pos];
-		pos += get_global_size(0);
-	}
+#if VECTOR_WIDTH == 1
+	real sum = acc;
+#else
+	real lanes[VECTOR_WIDTH];
+	CAT(vstore, VECTOR_WIDTH)(acc, 0, lanes);
+	real sum = 0;
+	for (int i = 0; i < VECTOR_WIDTH; i++)
+		sum += lanes[i];
+#endif
+
+	// the elements that don't fill a whole vector
+	const unsigned int tail = nvec * VECTOR_WIDTH + gid;
+	if (tail < dim)
+		sum += a[tail] * b[tail];
 
-	// if there are any items left to be computed, do that now
-	if (pos < dim)
-		dst[idx] += a[pos] * b[pos];
+#ifdef WG_SIZE
+	__local real scratch[WG_SIZE];
+	const unsigned int lid = get_local_id(0);
+
+	scratch[lid] = sum;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (unsigned int s = WG_SIZE / 2; s > 0; s >>= 1) {
+		if (lid < s)
+			scratch[lid] += scratch[lid + s];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	if (lid == 0)
+		dst[get_group_id(0)] = scratch[0];
+#else
+	dst[gid] = sum;
+#endif
 }
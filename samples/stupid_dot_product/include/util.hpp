@@ -2,6 +2,7 @@
 #define __UTIL_HPP__862143F7_968A_412F_9E6C_219937FCD443
 
 #include <CL/cl.h>
+#include "cl_0x.hpp"
 
 
 #define RELEASE(OBJ, FUNC)		\
@@ -20,34 +21,55 @@ void die (const char *errmsg, ...);
 
 
 /*
- * set up an open cl context and command queue, platform and device will be the
- * first available
+ * set up an open cl context and command queue on the device of type
+ * DEVICE_TYPE with the most compute units out of all platforms. the device can
+ * be overridden with the environment variable CL0X_DEVICE
  */
 void setup_opencl (cl_platform_id *pid, cl_device_id *dev, cl_context *ctx,
 		cl_command_queue *cmdq);
 
 
 /*
- * compile an OpenCL file for context ctx and store the resulting program in
- * prog, the resulting kernel in kernel. Note that this function can handle only
- * OpenCL files with one exported kernel
+ * compile an OpenCL file for context ctx with the build options (e.g. -D
+ * defines) and store the resulting program in prog, the resulting kernel in
+ * kernel. Note that this function can handle only OpenCL files with one
+ * exported kernel
  */
 void compile_kernel (const char *fname, const char *krnlname,
-		const cl_context *ctx, cl_program *prog, cl_kernel *kernel);
+		const cl_context *ctx, cl_program *prog, cl_kernel *kernel,
+		const char *options = NULL);
 
 
 /*
- * read a PPM file. don't forget to free data
+ * read a PPM file. the samples are normalized to [0, 1] on all hardware
+ * threads. don't forget to free data
  */
 void read_ppm (const char *fname, long int *w, long int *h, float *data[]);
 
 
 /*
- * write a PPM file
+ * read a PPM file straight into a newly allocated pinned buffer of context
+ * ctx, without an intermediate host copy
+ */
+void read_ppm (const char *fname, const cl_context ctx,
+		const cl_command_queue cmdq, long int *w, long int *h,
+		cl_0x::Buffer<float> &data);
+
+
+/*
+ * write a PPM file. the file is mapped and the samples are converted into the
+ * mapping on all hardware threads
  */
 void write_ppm (const char *fname, long int w, long int h, float *data);
 
 
+/*
+ * write a PPM file straight from the mapped buffer data
+ */
+void write_ppm (const char *fname, const cl_command_queue cmdq, long int w,
+		long int h, cl_0x::Buffer<float> &data);
+
+
 
 /*
  * get 'pinned' memory. though this is not guaranteed by CL_MEM_ALLOC_HOST_PTR,
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <vector>
 #include <CL/cl.h>
 #include "cl_0x.hpp"
 #include "util.hpp"
@@ -8,17 +9,11 @@ static cl_device_id dev;
 static cl_context ctx;
 static cl_command_queue cmdq;
 static cl_program prog;
-static cl_mem gpuArray[3];
-static cl_mem pinned[2];
-static cl_event ev[2];
 
 
 static void
 cleanup_opencl ()
 {
-	RELEASEN(ev, 2, clReleaseEvent);
-	RELEASEN(pinned, 2, clReleaseMemObject);
-	RELEASEN(gpuArray, 2, clReleaseMemObject);
 	RELEASE(prog, clReleaseProgram);
 	RELEASE(cmdq, clReleaseCommandQueue);
 	RELEASE(ctx, clReleaseContext);
@@ -32,68 +27,99 @@ main ()
 	cl_int err;
 	cl_0x::Kernel kernel;
 
-	atexit(cleanup_opencl);
-	setup_opencl(&pid, &dev, &ctx, &cmdq);
-	compile_kernel("cl/dotprod.cl", "dotprod", &ctx, &prog, &(kernel.cl_obj));
-
 	const unsigned int dim = 100000;
 	const size_t memsize = sizeof(cl_float) * dim;
-	get_pinned_memory(ctx, &pinned[0], memsize);
-	get_pinned_memory(ctx, &pinned[1], memsize);
-
-	float *h[2] = {NULL, NULL};
-	map(cmdq, pinned[0], &h[0], CL_MAP_WRITE, memsize);
-	map(cmdq, pinned[1], &h[1], CL_MAP_WRITE, memsize);
-	for (size_t i = 0; i < dim; i++) {
-		h[0][i] = 1.0f;
-		h[1][i] = 3.0f;
+
+	// the input lives in page-aligned host memory, which devices that share
+	// memory with the host use in place and others copy from at full speed
+	std::vector<float, cl_0x::AlignedAllocator<float>> h[2];
+	h[0].assign(dim, 1.0f);
+	h[1].assign(dim, 3.0f);
+
+	// small problems are done before the device would even be set up
+	cl_0x::Crossover crossover;
+	if (crossover.use_host(dim)) {
+		std::cout << cl_0x::host_dot(&h[0][0], &h[1][0], dim)
+			<< std::endl;
+		return 0;
 	}
-	unmap(cmdq, pinned[1], h[1]);
-	unmap(cmdq, pinned[0], h[0]);
 
-	create_mem_obj(ctx, gpuArray[0], CL_MEM_WRITE_ONLY, memsize);
-	create_mem_obj(ctx, gpuArray[1], CL_MEM_READ_ONLY, memsize);
-	create_mem_obj(ctx, gpuArray[2], CL_MEM_READ_ONLY, memsize);
+	atexit(cleanup_opencl);
+	setup_opencl(&pid, &dev, &ctx, &cmdq);
+
+	// build the kernel variant with the vector width the device prefers
+	cl_uint width = 1;
+	cl_0x::device_info(dev, CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT, &width);
+	if (width > 16 || (width & (width - 1)))
+		width = 1;
+	char options[32];
+	snprintf(options, sizeof(options), "-D VECTOR_WIDTH=%u", width);
+	compile_kernel("cl/dotprod.cl", "dotprod", &ctx, &prog, &(kernel.cl_obj),
+			options);
+
+	// zero-copy only pays off when the device works on host memory, a
+	// discrete device would read the input over the bus on every access
+	cl_bool zero_copy = CL_FALSE;
+	cl_0x::device_info(dev, CL_DEVICE_HOST_UNIFIED_MEMORY, &zero_copy);
+
+	cl_0x::Buffer<float> gpuArray[3];
+
+	err = gpuArray[0].mallocDevice(ctx, memsize, CL_MEM_READ_WRITE);
+	for (int i = 0; i < 2 && err == CL_SUCCESS; i++) {
+		if (zero_copy)
+			err = gpuArray[i + 1].useHostPtr(ctx, h[i],
+					CL_MEM_READ_ONLY);
+		else
+			err = gpuArray[i + 1].mallocDevice(ctx, memsize,
+					CL_MEM_READ_ONLY);
+	}
+	if (err != CL_SUCCESS)
+		die("ERROR: Could not allocate memory buffer object\n");
 
 	// set kernel arguments (the easy way)
 	err = kernel.set_args(gpuArray[0], gpuArray[1], gpuArray[2], dim);
 	if (err != CL_SUCCESS)
 		die("ERROR: Could not set kernel arguments\n");
 
-	// copy the data to the device
-	err = clEnqueueCopyBuffer(cmdq, pinned[0], gpuArray[1], 0, 0, memsize,
-			0, 0, &ev[0]);
-	err |= clEnqueueCopyBuffer(cmdq, pinned[1], gpuArray[2], 0, 0, memsize,
-			0, 0, &ev[1]);
-	if (err != CL_SUCCESS)
-		die("ERROR: Could not start data transfer to device\n");
+	// the commands are chained by events, the host only blocks when the
+	// result is read at the end
+	cl_0x::Event copied[2], computed;
 
-	// wait for copy to succeed
-	if (clWaitForEvents(2, ev) != CL_SUCCESS)
-		die("ERROR: Could not wait for copy to complete\n");
+	// copy the data to the device unless it is used in place
+	for (int i = 0; i < 2 && !zero_copy; i++) {
+		err = gpuArray[i + 1].write(cmdq, &h[i][0], cl_0x::EventList(),
+				&copied[i]);
+		if (err != CL_SUCCESS)
+			die("ERROR: Could not start data transfer to device\n");
+	}
 
-	// call the kernel
-	size_t threads = 1024;
-	size_t tpb = 64;
-	err = clEnqueueNDRangeKernel(cmdq, kernel.cl_obj, 1, NULL, &threads, &tpb, 0,
-			NULL, &ev[0]);
+	// call the kernel as soon as the input is on the device. the number of
+	// threads and the work-group size are tuned at the first run and read
+	// from dotprod.tune afterwards
+	cl_0x::AutoTuner tuner("dotprod.tune");
+	cl_0x::LaunchConfig cfg;
+	tuner.load();
+	err = tuner.run(kernel, cmdq, dim, true,
+			cl_0x::EventList(copied[0], copied[1]), &computed, &cfg);
 	if (err != CL_SUCCESS)
 		die("ERROR: Could not enqueue kernel\n");
-	if (clWaitForEvents(1, &ev[0]) != CL_SUCCESS)
-		die("ERROR: Could not wait for kernel\n");
-
-	// copy data back to host
-	err = clEnqueueCopyBuffer(cmdq, gpuArray[0], pinned[0], 0, 0, memsize,
-			0, 0, &ev[0]);
-	if (err != CL_SUCCESS || clWaitForEvents(1, &ev[0]) != CL_SUCCESS)
-		die("ERROR: Could not transfer data to host\n");
-
-	// finish
-	double finalDotProduct = 0.0;
-	map(cmdq, pinned[0], &h[0], CL_MAP_READ, memsize);
-	for (size_t i = 0; i < threads; i++)
-		finalDotProduct += h[0][i];
-	unmap(cmdq, pinned[0], &h[0]);
+
+	// sum up the partial results on the device, only the final value is
+	// transferred back to the host
+	cl_0x::Context context;
+	cl_0x::Device device;
+	context.reset(ctx, false);
+	device.reset(dev, false);
+
+	cl_0x::Reduction<float> sum;
+	if (sum.create(context, device) != CL_SUCCESS)
+		die("ERROR: Could not create reduction kernel\n");
+
+	float finalDotProduct = 0.0f;
+	err = sum.run(cmdq, gpuArray[0], cfg.global, &finalDotProduct,
+			computed);
+	if (err != CL_SUCCESS)
+		die("ERROR: Could not reduce partial results\n");
 
 	std::cout << finalDotProduct << std::endl;
 
@@ -1,4 +1,5 @@
 #include "util.hpp"
+#include "cl_0x.hpp"
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -26,12 +27,24 @@ setup_opencl (cl_platform_id *pid, cl_device_id *dev, cl_context *ctx,
 		cl_command_queue *cmdq)
 {
 	cl_int err;
-
-	if (clGetPlatformIDs(1, pid, NULL) != CL_SUCCESS)
-		die("ERROR: No OpenCL Platform presen!\n");
-
-	if (clGetDeviceIDs(*pid, DEVICE_TYPE, 1, dev, NULL) != CL_SUCCESS)
-		die("ERROR: Could not open OpenCL device\n");
+	cl_0x::Platform platform;
+	cl_0x::Device device;
+	cl_0x::DeviceInfo info;
+
+	// take the device with the most compute units, unless CL0X_DEVICE
+	// says otherwise
+	err = cl_0x::select_device(platform, device,
+			cl_0x::DEVICE_MOST_COMPUTE_UNITS, DEVICE_TYPE, NULL,
+			&info);
+	if (err != CL_SUCCESS)
+		die("ERROR: Could not open OpenCL device (%d)\n", err);
+	*pid = platform();
+	*dev = device();
+#ifdef DEBUG
+	fprintf(stderr, "using %s: %s (%u compute units)\n",
+			info.platform_name.c_str(), info.name.c_str(),
+			info.compute_units);
+#endif
 
 	cl_context_properties props[] = {CL_CONTEXT_PLATFORM,
 		(cl_context_properties)*pid, 0};
@@ -47,7 +60,7 @@ setup_opencl (cl_platform_id *pid, cl_device_id *dev, cl_context *ctx,
 
 void
 compile_kernel (const char *fname, const char *krnlname, const cl_context *ctx,
-		cl_program *prog, cl_kernel *kernel)
+		cl_program *prog, cl_kernel *kernel, const char *options)
 {
 	cl_int err;
 	const char *src;
@@ -61,13 +74,14 @@ compile_kernel (const char *fname, const char *krnlname, const cl_context *ctx,
 		die("ERROR: Could not open file %s\n", fname);
 	src = (char*)mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
 
-	size_t len[] = {strlen(src)};
+	// the mapping is not zero terminated
+	size_t len[] = {(size_t)sb.st_size};
 	*prog = clCreateProgramWithSource(*ctx, 1, &src, len, &err);
 	if (err != CL_SUCCESS)
 		die("ERROR: Could not create program object from source %s\n",
 				fname);
 
-	if (clBuildProgram(*prog, 0, NULL, NULL, NULL, NULL) != CL_SUCCESS)
+	if (clBuildProgram(*prog, 0, NULL, options, NULL, NULL) != CL_SUCCESS)
 		die("ERROR: Could not compile program\n");
 
 	*kernel = clCreateKernel(*prog, krnlname, &err);
@@ -110,8 +124,13 @@ get_scalar (unsigned int *i, const char *ppm)
 	return result;
 }
 
-void
-read_ppm (const char *fname, long int *w, long int *h, float *data[])
+/*
+ * map the PPM file fname and parse its header. returns a pointer to the first
+ * pixel byte, the mapping has to be released with munmap(*map, *maplen)
+ */
+static const unsigned char*
+map_ppm (const char *fname, long int *w, long int *h, long int *maxval,
+		void **map, size_t *maplen)
 {
 	int fd = -1;
 	unsigned int i;
@@ -121,12 +140,14 @@ read_ppm (const char *fname, long int *w, long int *h, float *data[])
 	if ((stat(fname, &sb) < 0) || ((fd = open(fname, O_RDONLY)) < 0))
 		die("ERROR: Could not open file %s\n", fname);
 
-	ppm = (char*)mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (!ppm)
+	*map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (*map == MAP_FAILED)
 		die("ERROR: Could not read from file %s\n", fname);
+	ppm = (const char*)*map;
 
 	i = 2;
-	if (strncmp(ppm, "P6", 2))
+	if (sb.st_size < 2 || strncmp(ppm, "P6", 2))
 		die("ERROR: PPM not in a valid format\n");
 
 	eat_whitespace(sb.st_size, &i, ppm);
@@ -137,48 +158,134 @@ read_ppm (const char *fname, long int *w, long int *h, float *data[])
 	*h = get_scalar(&i, ppm);
 	eat_whitespace(sb.st_size, &i, ppm);
 
-	long int maxval = get_scalar(&i, ppm);
+	*maxval = get_scalar(&i, ppm);
 	i++;
 
-	size_t npixels = (*w) * (*h);
-	*data = (float*)malloc(sizeof(float) * npixels * 3);
+	// only one byte per sample is supported
+	if (*w <= 0 || *h <= 0 || *maxval <= 0 || *maxval > 255)
+		die("ERROR: PPM not in a valid format\n");
+	if ((size_t)sb.st_size < i + (size_t)(*w) * (*h) * 3)
+		die("ERROR: PPM file %s is truncated\n", fname);
+
+	*maplen = sb.st_size;
+	return (const unsigned char*)ppm + i;
+}
 
-	for (size_t j = 0; j < npixels * 3; j++, i++) {
-		float v = (float)(unsigned char)ppm[i] / (float)maxval;
-		(*data)[j] = (v > 1.0) ? 1.0 : v;
-	}
 
-	munmap((void*)ppm, sb.st_size);
+/*
+ * create the PPM file fname, write its header and map it for writing.
+ * returns a pointer to the first pixel byte, the mapping has to be released
+ * with munmap(*map, *maplen)
+ */
+static unsigned char*
+create_ppm (const char *fname, long int w, long int h, void **map,
+		size_t *maplen)
+{
+	char header[64];
+	int hlen = snprintf(header, sizeof(header), "P6\n%ld %ld\n255\n", w, h);
+
+	int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		die("ERROR: Coult not open file %s to write\n", fname);
+
+	*maplen = hlen + (size_t)w * h * 3;
+	if (ftruncate(fd, *maplen) < 0)
+		die("ERROR: Could not write data to file\n");
+
+	*map = mmap(NULL, *maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 	close(fd);
+	if (*map == MAP_FAILED)
+		die("ERROR: Could not write data to file\n");
+
+	memcpy(*map, header, hlen);
+	return (unsigned char*)*map + hlen;
+}
+
+
+void
+read_ppm (const char *fname, long int *w, long int *h, float *data[])
+{
+	void *map;
+	size_t maplen;
+	long int maxval;
+	const unsigned char *pixels = map_ppm(fname, w, h, &maxval, &map,
+			&maplen);
+
+	size_t n = (size_t)(*w) * (*h) * 3;
+	*data = (float*)malloc(sizeof(float) * n);
+	if (!*data)
+		die("ERROR: Could not allocate memory\n");
+
+	cl_0x::host_unorm8_to_float(pixels, *data, n, 1.0f / maxval, 0);
+	munmap(map, maplen);
+}
+
+
+void
+read_ppm (const char *fname, const cl_context ctx, const cl_command_queue cmdq,
+		long int *w, long int *h, cl_0x::Buffer<float> &data)
+{
+	void *map;
+	size_t maplen;
+	long int maxval;
+	const unsigned char *pixels = map_ppm(fname, w, h, &maxval, &map,
+			&maplen);
+
+	size_t n = (size_t)(*w) * (*h) * 3;
+	if (data.mallocHost(ctx, sizeof(float) * n) != CL_SUCCESS)
+		die("ERROR: Could not allocate pinned memory\n");
+
+	cl_int err;
+	float *dst = data.map(cmdq, &err, CL_MAP_WRITE);
+	if (err != CL_SUCCESS)
+		die("ERROR: Could not map pointer to pinned memory\n");
+
+	cl_0x::host_unorm8_to_float(pixels, dst, n, 1.0f / maxval, 0);
+	munmap(map, maplen);
+
+	if (data.unmap(cmdq) != CL_SUCCESS)
+		die("ERROR: Could not unmap pointer\n");
 }
 
 
 void
 write_ppm (const char *fname, long int w, long int h, float *data)
 {
-	FILE *f = fopen(fname, "wb");
-	if (!f)
-		die("ERROR: Coult not open file %s to write\n", fname);
+	void *map;
+	size_t maplen;
+	unsigned char *pixels = create_ppm(fname, w, h, &map, &maplen);
 
-	size_t npixels = w * h;
-	unsigned char *buf =
-		(unsigned char*)malloc(sizeof(unsigned char) * npixels * 3);
+	cl_0x::host_float_to_unorm8(data, pixels, (size_t)w * h * 3, 0);
+	munmap(map, maplen);
+}
 
-	for (size_t i = 0; i < npixels * 3; i++) {
-		float v = data[i] * 255.f;
-		buf[i] = (unsigned char)v;
-	}
 
-	fprintf(f, "P6\n%ld %ld\n255\n", w, h);
-	int result = fwrite(buf, sizeof(unsigned char) * npixels * 3, 1, f);
-	if (result != 1)
-		die("ERROR: Could not write data to file\n");
-	free(buf);
-	fclose(f);
+void
+write_ppm (const char *fname, const cl_command_queue cmdq, long int w,
+		long int h, cl_0x::Buffer<float> &data)
+{
+	size_t n = (size_t)w * h * 3;
+	if (data.size < sizeof(float) * n)
+		die("ERROR: Buffer too small for a %ldx%ld PPM\n", w, h);
+
+	cl_int err;
+	const float *src = data.map(cmdq, &err, CL_MAP_READ);
+	if (err != CL_SUCCESS)
+		die("ERROR: Could not map pointer to pinned memory\n");
+
+	void *map;
+	size_t maplen;
+	unsigned char *pixels = create_ppm(fname, w, h, &map, &maplen);
+	cl_0x::host_float_to_unorm8(src, pixels, n, 0);
+	munmap(map, maplen);
+
+	if (data.unmap(cmdq) != CL_SUCCESS)
+		die("ERROR: Could not unmap pointer\n");
 }
 
 
 
+
 void
 get_pinned_memory (const cl_context &ctx, cl_mem *memobj, size_t size,
 		cl_mem_flags flags)